@@ -34,12 +34,15 @@
 #include <idp.hpp>
 #include <loader.hpp>
 #include <nalt.hpp>
+#include <netnode.hpp>
 #include <kernwin.hpp>
 #include <auto.hpp>
 #include <funcs.hpp>
 #include <range.hpp>
 #include <ua.hpp>
 #include <typeinf.hpp>
+#include <bytes.hpp>
+#include <strlist.hpp>
 #include <pro.h>
 
 /*
@@ -51,15 +54,46 @@
 #define _USE_MATH_DEFINES
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
 #include <cmath>
+#include <cstring>
 #include <exception>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <list>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/*
+ * =====================================================================================
+ * system includes
+ * =====================================================================================
+ */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 //for backwards compatibility with IDA SDKs < 7.3
 #include "compat.h"
@@ -100,6 +134,50 @@ static const char wanted_hotkey[] = "";
 // basedir relative to $HOME
 constexpr char bintag_basedir[] = ".bintag";
 
+// configuration file relative to basedir
+constexpr char bintag_config[] = "config";
+
+// preprocessed tag cache relative to basedir
+constexpr char bintag_cache[] = "cache";
+constexpr char bintag_cache_lock[] = "cache.lock"; // flock'ed while the cache is read or written
+constexpr char bintag_cache_magic[] = "BTC1";
+constexpr uint32_t bintag_cache_version = 12;
+constexpr uint8_t bintag_cache_mnemonics = 'M';   // record: mnemonic names appended
+constexpr uint8_t bintag_cache_put = 'P';         // record: tag added or changed
+constexpr uint8_t bintag_cache_erase = 'E';       // record: tag removed
+constexpr size_t bintag_cache_slack = 64;         // records tolerated beyond 2 per tag
+
+// netnode holding the sample histogram in the idb
+constexpr char bintag_netnode[] = "$ bintag";
+constexpr nodeidx_t bintag_generation_idx = 0;    // altval: database generation
+constexpr nodeidx_t bintag_histogram_idx = 0;     // blob: cached histogram
+constexpr uchar bintag_histogram_tag = 'H';
+constexpr uint32_t bintag_histogram_version = 7;
+
+// pseudo functions aggregating library and thunk functions and functions
+// below the instruction threshold
+constexpr ea_t bintag_lib_bucket_ea = BADADDR - 1;
+constexpr ea_t bintag_tiny_bucket_ea = BADADDR - 2;
+constexpr char bintag_lib_bucket_name[] = "$library";
+constexpr char bintag_tiny_bucket_name[] = "$tiny";
+
+// function pairs with fewer mnemonics than dim / ratio use the sparse kernel
+constexpr size_t bintag_sparse_ratio = 8;
+
+// minhash signatures of import lists, banded for the lsh index. Tags sharing
+// a band with the sample are listed if their estimated jaccard similarity
+// reaches bintag_import_similar.
+constexpr size_t bintag_minhash_size = 64;
+constexpr size_t bintag_lsh_bands = 16;
+constexpr double bintag_import_similar = 0.5;
+
+// bloom filters of import sets, sized per tag for a few percent false positives
+constexpr size_t bintag_bloom_bits_per_import = 8;
+constexpr size_t bintag_bloom_probes = 3;
+
+// tags with a combined distance below are listed
+constexpr double bintag_display_distance = 5.0;
+
 /*
  * =====================================================================================
  * function declarations
@@ -128,6 +206,219 @@ struct add_tag_ah_t : public action_handler_t {
     }
 };
 
+// treatment of functions marked FUNC_LIB or FUNC_THUNK
+enum lib_policy_t {
+    LIB_KEEP,       // compared like any other function
+    LIB_EXCLUDE,    // left out
+    LIB_BUCKET,     // aggregated into a single pseudo function
+};
+
+static const char *const lib_policy_names[] = { "keep", "exclude", "bucket" };
+
+// element type of the dense vectors compared by the distance kernel
+enum vector_storage_t {
+    STORAGE_DOUBLE,
+    STORAGE_FLOAT,
+    STORAGE_INT16,      // quantized to 15 bit if counts exceed it
+    STORAGE_UINT8,      // quantized to 8 bit if counts exceed it
+};
+
+static const char *const vector_storage_names[] = { "double", "float", "int16", "uint8" };
+
+// features combined into the distance of a tag, cheapest first
+enum channel_id_t {
+    CHANNEL_IMPORTS,    // jaccard distance of the import sets
+    CHANNEL_STRINGS,    // jaccard distance of the string sets
+    CHANNEL_SIZES,      // distance of the function size distributions
+    CHANNEL_MNEMONICS,  // mnemonic histogram distance
+    CHANNEL_COUNT,
+};
+
+static const char *const channel_names[] = { "imports", "strings", "sizes", "mnemonics" };
+
+// settings read from the configuration file
+struct bintag_config_t {
+    lib_policy_t lib_policy;
+    uint32_t min_insns;     // smaller functions go to the tiny bucket
+    vector_storage_t storage;
+    bool verify_storage;    // measure the score error of the storage type
+    size_t class_prefilter; // tags kept by the mnemonic class ranking, 0 for all
+    size_t sketch_candidates; // pairs evaluated per function by sketch estimate, 0 for all
+    double import_threshold;  // minimum estimated import similarity, 0 for all tags
+    double size_threshold;    // maximum size distribution distance, 0 for all tags
+    double weights[CHANNEL_COUNT]; // weight of each channel, 0 disables it
+    bintag_config_t() : lib_policy(LIB_KEEP), min_insns(0), storage(STORAGE_DOUBLE),
+        verify_storage(false), class_prefilter(0), sketch_candidates(0), import_threshold(0.0),
+        size_threshold(0.0), weights{0.0, 0.0, 0.0, 1.0} {}
+};
+
+// coarse classes of mnemonics, the low-dimensional representation of tags
+enum mnemonic_class_t {
+    CLASS_DATA,         // data movement and stack
+    CLASS_ARITH,
+    CLASS_LOGIC,        // bitwise operations, shifts and tests
+    CLASS_CONTROL,
+    CLASS_STRING,
+    CLASS_FPU,
+    CLASS_SIMD,
+    CLASS_OTHER,
+};
+
+// assigns mnemonics matching pattern to a class, patterns are either a
+// mnemonic, a prefix ending in '*' or a suffix starting with '*'
+struct class_rule_t {
+    const char *pattern;
+    mnemonic_class_t cls;
+};
+
+// class rules of a processor module, the first matching rule applies
+struct class_table_t {
+    int proc_id;
+    const class_rule_t *rules;
+    size_t size;
+};
+
+// sparse mnemonic histogram of a single function, sorted by mnemonic id
+struct fhist_t {
+    std::vector<std::pair<uint32_t, uint32_t> > counts;
+    double sqnorm; // squared euclidean norm of counts
+    uint64_t sketch; // simhash of counts, see sketch_fhist()
+    fhist_t() : sqnorm(0.0), sketch(0) {}
+};
+
+// tag in the preprocessed form used for matching
+struct tag_t {
+    std::string name;
+    std::string description;
+    bool is_32bit;
+    bool is_64bit;
+    lib_policy_t lib_policy;        // extraction settings the tag was built with
+    uint32_t min_insns;
+    std::vector<std::string> imports;
+    std::vector<uint64_t> import_hashes;    // sorted hashes of the imports
+    std::vector<uint64_t> import_minhash;   // empty without imports
+    std::vector<uint64_t> import_bloom;     // empty without imports
+    std::vector<uint64_t> string_hashes;    // sorted hashes of the strings
+    std::vector<uint32_t> sizes;            // sorted instruction counts of the functions
+    std::vector<fhist_t> functions;
+    tag_t() : is_32bit(false), is_64bit(false), lib_policy(LIB_KEEP), min_insns(0) {}
+};
+
+// fnv-1a followed by the splitmix64 finalizer to spread the bits, stable
+// across sessions
+static uint64_t hash_string(const std::string &str) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char c : str)
+        h = (h ^ c) * 0x100000001b3ull;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+// interning table for mnemonics, fhist_t refers to mnemonics by their index
+struct mnemonic_table_t {
+    std::vector<std::string> names;
+    std::vector<uint64_t> hashes;   // stable hash of each name
+    std::unordered_map<std::string, uint32_t> ids;
+
+    uint32_t intern(const std::string &mnem) {
+        auto it = ids.find(mnem);
+        if (it != ids.end())
+            return it->second;
+        uint32_t id = names.size();
+        names.push_back(mnem);
+        hashes.push_back(hash_string(mnem));
+        ids[mnem] = id;
+        return id;
+    }
+};
+
+// decoded instructions of a function in address order, tail chunks included
+struct func_insns_t {
+    std::vector<uint16_t> itypes;
+};
+
+// mnemonic histograms of the loaded sample by function entry address, tail
+// chunks are accounted to their owner
+struct sample_hist_t {
+    // function aggregated into a bucket, its counts are kept so a change only
+    // touches the counts of the bucket instead of all members
+    struct member_t {
+        ea_t bucket;
+        fhist_t counts;
+    };
+
+    lib_policy_t lib_policy;
+    uint32_t min_insns;
+    std::vector<ea_t> eas;
+    std::vector<fhist_t> functions;
+    std::map<ea_t, member_t> members;                       // by function entry
+    std::map<ea_t, std::vector<uint64_t> > bucket_counts;   // by bucket, indexed by mnemonic id
+    bool cancelled;
+    sample_hist_t() : lib_policy(LIB_KEEP), min_insns(0), cancelled(false) {}
+};
+
+// row and column minima of the distance matrix of a tag against the sample,
+// rows are the functions of the tag and columns the functions of the sample
+struct score_state_t {
+    uintmax_t size;                 // state of the tag file
+    fs::file_time_type mtime;
+    std::vector<double> row_min;
+    std::vector<ea_t> row_argmin;   // sample function of the row minimum
+    std::vector<double> col_min;    // in the order of the scored sample
+};
+
+// changes of the sample since the last run
+struct sample_delta_t {
+    std::vector<int64_t> col_source;    // column in the last run or -1 if changed
+    std::unordered_set<ea_t> stale;     // functions changed or removed
+};
+
+// tag loaded from the tag directory, size and mtime identify the file state
+struct tag_entry_t {
+    uintmax_t size;
+    fs::file_time_type mtime;
+    tag_t tag;
+};
+
+// lsh index over the import minhash signatures of the corpus, buckets are
+// keyed by the hash of a band and its number
+struct import_index_t {
+    struct entry_t {
+        uintmax_t size;             // state of the tag file
+        fs::file_time_type mtime;
+        std::vector<uint64_t> keys; // band keys the path is filed under
+    };
+    std::map<std::string, entry_t> indexed;
+    std::unordered_map<uint64_t, std::set<std::string> > buckets;
+};
+
+// sample features shared by all channels during a run
+struct score_ctx_t {
+    const sample_hist_t *h;
+    const sample_delta_t *delta;    // NULL if the minima can not be reused
+    std::vector<uint64_t> imports;  // sorted hashes
+    std::vector<uint64_t> strings;  // sorted hashes
+    std::vector<uint32_t> sizes;    // sorted instruction counts
+    std::set<std::string> scored;   // tags the mnemonic channel ran on
+    bool verify;
+    double storage_error;
+};
+
+// A feature channel maps a tag to a distance >= 0. bound is a cheap lower
+// bound of the distance returned by score.
+struct channel_t {
+    double (*bound)(score_ctx_t *ctx, const std::string &path, const tag_entry_t &e);
+    double (*score)(score_ctx_t *ctx, const std::string &path, const tag_entry_t &e);
+};
+
+// functions of a tag projected onto the mnemonic classes
+struct class_state_t {
+    uintmax_t size;                 // state of the tag file
+    fs::file_time_type mtime;
+    std::vector<fhist_t> functions; // histograms over class ids
+};
+
 struct bintag_info_t {
     TWidget *cv;
     strvec_t sv;
@@ -143,6 +434,138 @@ struct bintag_info_t {
 static const bintag_info_t *last_si = NULL;
 static add_tag_ah_t add_tag_ah;
 
+static bintag_config_t config;
+
+// all tags currently known, keyed by tag file path
+static std::map<std::string, tag_entry_t> corpus;
+static bool corpus_loaded = false;
+
+// state of the cache file, which is a log of records appended on every
+// store and rewritten as a whole once outdated records dominate
+static std::set<std::string> cache_changes;    // paths put or erased since the last store
+static bool cache_rewrite = true;               // the log can not be appended to
+static size_t cache_records = 0;                // tag records in the log
+static std::vector<uint32_t> cache_ids;         // interned ids of the mnemonic ids of the log
+static uintmax_t cache_size = 0;                // size of the log as last read or written
+static ino_t cache_inode = 0;                   // inode of the log as last read or written
+
+// inotify watch on the tag directory, the watcher thread collects the names
+// of changed files in tag_updates
+static std::thread watcher;
+static int watch_fd = -1;
+static int watch_stop_fd = -1;
+static std::mutex tag_updates_lock;
+static std::set<std::string> tag_updates;
+static bool tag_rescan = false;
+
+// interned mnemonics of the corpus and the loaded sample
+static mnemonic_table_t mnemonics;
+
+// true once the generation was increased after the histogram was last cached
+static bool generation_changed = false;
+
+// histogram of the loaded sample, kept up to date with dirty_functions
+static sample_hist_t sample;
+static bool sample_valid = false;
+static std::set<ea_t> dirty_functions;
+
+// minima of the last run by tag path, retained to re-score changed samples
+static std::map<std::string, score_state_t> scores;
+static std::vector<ea_t> scored_eas;            // sample functions of the last run
+static std::set<ea_t> rescore_functions;        // functions changed since the last run
+static bool rescore_all = true;
+
+// class of each interned mnemonic for the processor in class_proc and the
+// class representation of tags by tag path
+static int class_proc = -1;
+static std::vector<uint8_t> mnemonic_classes;
+static std::map<std::string, class_state_t> tag_classes;
+
+static import_index_t import_index;
+
+// output of the headless export, see export_tag()
+static std::string export_path;
+
+/*
+ * =====================================================================================
+ * instruction counting
+ * =====================================================================================
+ */
+
+// Maps the itype of decoded instructions to interned mnemonic ids, mnemonic
+// strings are only looked up once per itype.
+struct itype_map_t {
+    static constexpr uint32_t unmapped = std::numeric_limits<uint32_t>::max();
+
+    std::vector<uint32_t> ids;      // interned mnemonic id of each itype
+
+    void add(const insn_t &insn) {
+        uint16_t itype = insn.itype;
+        if (itype >= ids.size())
+            ids.resize(itype + 1, unmapped);
+        if (ids[itype] == unmapped) {
+            auto mnem = insn.get_canon_mnem();
+            ids[itype] = mnemonics.intern(mnem != NULL ? mnem : "");
+        }
+    }
+
+    uint32_t operator[](uint16_t itype) const {
+        return ids[itype];
+    }
+};
+
+// decoded instructions by function entry, see get_func_insns()
+static std::unordered_map<ea_t, func_insns_t> insn_cache;
+static itype_map_t itypes;
+
+// Instruction counters of the function currently being counted. Counting an
+// instruction is an array increment.
+struct mnemonic_counter_t {
+    std::vector<uint32_t> counts;   // indexed by mnemonic id
+    std::vector<uint32_t> used;     // mnemonic ids with non-zero counts
+
+    void add(uint32_t id) {
+        if (id >= counts.size())
+            counts.resize(id + 1, 0);
+        if (counts[id]++ == 0)
+            used.push_back(id);
+    }
+
+    // moves the counts into f, finalize_fhist() must be called afterwards
+    void flush(fhist_t *f) {
+        for (auto id : used) {
+            f->counts.push_back({id, counts[id]});
+            counts[id] = 0;
+        }
+        used.clear();
+    }
+};
+
+/*
+ * =====================================================================================
+ * threading helpers
+ * =====================================================================================
+ */
+
+// Calls f(k) for k in [0, n) on a pool of worker threads, one per core. The
+// calling thread takes part and the call returns once all work is done.
+template<typename F>
+static void parallel_for(size_t n, F f) {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t k; (k = next++) < n; )
+            f(k);
+    };
+
+    size_t t = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), n);
+    std::vector<std::thread> workers;
+    for (size_t w=1; w<t; w++)
+        workers.emplace_back(worker);
+    worker();
+    for (auto &w : workers)
+        w.join();
+}
+
 /*
  * =====================================================================================
  * filesystem related functions
@@ -163,33 +586,1072 @@ static fs::path get_tag_dir() {
     return get_config_dir() / "tags";
 }
 
-static std::list<json> load_tags() {
-    auto tag_dir = get_tag_dir();
+/*
+ * =====================================================================================
+ * configuration
+ * =====================================================================================
+ */
+
+template<typename E, size_t N>
+static bool parse_enum(const std::string &name, const char *const (&names)[N], E *value) {
+    for (size_t k=0; k<N; k++) {
+        if (name == names[k]) {
+            *value = E(k);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_lib_policy(const std::string &name, lib_policy_t *policy) {
+    return parse_enum(name, lib_policy_names, policy);
+}
+
+// Reads the configuration file, missing settings keep their defaults.
+static void load_config() {
+    config = bintag_config_t();
+    auto config_file = get_config_dir() / bintag_config;
+    std::ifstream i(config_file);
+    if (!i)
+        return;
+
+    try {
+        json c;
+        i >> c;
+        if (c.contains("library_functions") &&
+                !parse_lib_policy(c["library_functions"].get<std::string>(), &config.lib_policy))
+            msg("BinTag [WARNING]: unknown library_functions policy in %s\n", config_file.c_str());
+        // functions without instructions are always left out, 1 is the same as 0
+        config.min_insns = c.value("min_instructions", config.min_insns);
+        if (config.min_insns == 1)
+            config.min_insns = 0;
+        if (c.contains("vector_storage") &&
+                !parse_enum(c["vector_storage"].get<std::string>(), vector_storage_names, &config.storage))
+            msg("BinTag [WARNING]: unknown vector_storage in %s\n", config_file.c_str());
+        config.verify_storage = c.value("verify_storage", config.verify_storage);
+        config.class_prefilter = c.value("class_prefilter", config.class_prefilter);
+        config.import_threshold = c.value("import_threshold", config.import_threshold);
+        config.sketch_candidates = c.value("sketch_candidates", config.sketch_candidates);
+        config.size_threshold = c.value("size_threshold", config.size_threshold);
+        if (c.contains("weights")) {
+            for (auto &[name, w] : c["weights"].items()) {
+                channel_id_t id;
+                if (parse_enum(name, channel_names, &id) && w.get<double>() >= 0.0)
+                    config.weights[id] = w.get<double>();
+                else
+                    msg("BinTag [WARNING]: ignoring weight %s in %s\n", name.c_str(), config_file.c_str());
+            }
+            if (std::all_of(std::begin(config.weights), std::end(config.weights),
+                        [](double w) { return w == 0.0; })) {
+                msg("BinTag [WARNING]: all weights are 0 in %s, using the defaults\n", config_file.c_str());
+                bintag_config_t defaults;
+                std::copy(std::begin(defaults.weights), std::end(defaults.weights), std::begin(config.weights));
+            }
+        }
+    } catch (json::exception &e) {
+        msg("BinTag [WARNING]: ignoring broken config %s: %s\n", config_file.c_str(), e.what());
+        config = bintag_config_t();
+    }
+}
+
+/*
+ * =====================================================================================
+ * preprocessing of tags and histograms
+ * =====================================================================================
+ */
+
+// sorts the counts of f by mnemonic id, adds up duplicates and computes the norm
+static void finalize_fhist(fhist_t *f) {
+    std::sort(f->counts.begin(), f->counts.end());
+    size_t n = 0;
+    for (size_t k=0; k<f->counts.size(); k++) {
+        if (n > 0 && f->counts[n-1].first == f->counts[k].first)
+            f->counts[n-1].second += f->counts[k].second;
+        else
+            f->counts[n++] = f->counts[k];
+    }
+    f->counts.resize(n);
+
+    f->sqnorm = 0.0;
+    for (auto &[id, count] : f->counts)
+        f->sqnorm += double(count) * double(count);
+}
+
+// instructions of a function, the sum of its mnemonic counts
+static uint64_t count_instructions(const fhist_t &f) {
+    uint64_t n = 0;
+    for (auto &[id, count] : f.counts)
+        n += count;
+    return n;
+}
+
+// sorted instruction counts of finalized histograms
+static std::vector<uint32_t> function_sizes(const std::vector<fhist_t> &functions) {
+    std::vector<uint32_t> sizes;
+    sizes.reserve(functions.size());
+    for (auto &f : functions) {
+        auto n = count_instructions(f);
+        sizes.push_back(uint32_t(std::min<uint64_t>(n, std::numeric_limits<uint32_t>::max())));
+    }
+    std::sort(sizes.begin(), sizes.end());
+    return sizes;
+}
+
+// Computes the simhash of a finalized histogram: every mnemonic adds its
+// count to the bits set in its hash and subtracts it from the others, the
+// signs form the sketch. The fraction of bits two sketches differ in
+// estimates the angle between the histograms divided by pi.
+static void sketch_fhist(fhist_t *f, const mnemonic_table_t &table) {
+    int64_t acc[64] = {};
+    for (auto &[id, count] : f->counts) {
+        uint64_t h = table.hashes[id];
+        for (int b=0; b<64; b++)
+            acc[b] += ((h >> b) & 1) != 0 ? int64_t(count) : -int64_t(count);
+    }
+    f->sketch = 0;
+    for (int b=0; b<64; b++) {
+        if (acc[b] > 0)
+            f->sketch |= uint64_t(1) << b;
+    }
+}
+
+static void sort_hashes(std::vector<uint64_t> *hashes) {
+    std::sort(hashes->begin(), hashes->end());
+    hashes->erase(std::unique(hashes->begin(), hashes->end()), hashes->end());
+}
+
+// hashes a list of imports or strings into a sorted set
+static std::vector<uint64_t> hash_set(const std::vector<std::string> &strs) {
+    std::vector<uint64_t> hashes;
+    hashes.reserve(strs.size());
+    for (auto &str : strs)
+        hashes.push_back(hash_string(str));
+    sort_hashes(&hashes);
+    return hashes;
+}
+
+// Bloom filter of a hashed import set, the probes are taken from disjoint
+// bits of the already mixed hashes
+static std::vector<uint64_t> bloom_imports(const std::vector<uint64_t> &hashes) {
+    if (hashes.empty())
+        return std::vector<uint64_t>();
+    size_t words = 1;
+    while (words*64 < hashes.size() * bintag_bloom_bits_per_import)
+        words *= 2;
+    std::vector<uint64_t> bloom(words, 0);
+    for (auto h : hashes) {
+        for (size_t k=0; k<bintag_bloom_probes; k++) {
+            size_t bit = (h >> (k*21)) & (words*64 - 1);
+            bloom[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+    }
+    return bloom;
+}
+
+// MinHash signature of a hashed import set, the fraction of equal positions
+// of two signatures estimates the jaccard similarity of the sets
+static std::vector<uint64_t> minhash_imports(const std::vector<uint64_t> &hashes) {
+    if (hashes.empty())
+        return std::vector<uint64_t>();
+    std::vector<uint64_t> sig(bintag_minhash_size, std::numeric_limits<uint64_t>::max());
+    for (auto h : hashes) {
+        for (size_t k=0; k<bintag_minhash_size; k++) {
+            // splitmix64 of the hash with a seed per position
+            uint64_t x = h + (k+1) * 0x9e3779b97f4a7c15ull;
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+            sig[k] = std::min(sig[k], x ^ (x >> 31));
+        }
+    }
+    return sig;
+}
+
+// converts a json histogram { function: { mnemonic: count } } to vectors
+static std::vector<fhist_t> histogram_to_vectors(const json &h, mnemonic_table_t *table = &mnemonics) {
+    std::vector<fhist_t> functions;
+    functions.reserve(h.size());
+    for (auto &[fname, fhist] : h.items()) {
+        fhist_t f;
+        f.counts.reserve(fhist.size());
+        for (auto &[mnem, count] : fhist.items())
+            f.counts.push_back({table->intern(mnem), count.get<uint32_t>()});
+        finalize_fhist(&f);
+        sketch_fhist(&f, *table);
+        functions.push_back(std::move(f));
+    }
+    return functions;
+}
+
+static void add_to_bucket(fhist_t *bucket, const fhist_t &f) {
+    bucket->counts.insert(bucket->counts.end(), f.counts.begin(), f.counts.end());
+}
+
+static void append_tag_bucket(std::vector<fhist_t> *functions, fhist_t *bucket, const mnemonic_table_t &table) {
+    if (bucket->counts.empty())
+        return;
+    finalize_fhist(bucket);
+    sketch_fhist(bucket, table);
+    functions->push_back(std::move(*bucket));
+}
+
+// Applies the configured extraction settings to a tag built with other ones,
+// as far as the tag allows, the same way classify_function() treats sample
+// functions:
+//  - library functions of a tag built with keep are left out or aggregated,
+//    the $library row of a tag built with bucket can be left out
+//  - functions with fewer instructions than configured are aggregated into
+//    the $tiny row of a tag built with a lower threshold
+// names are the function names of the rows, library the names of the library
+// and thunk functions. Tags that can not be adapted keep their settings and
+// are skipped by skip_tag().
+static void adapt_tag(tag_t *tag, const std::vector<std::string> &names,
+        const std::set<std::string> &library, const mnemonic_table_t &table) {
+    bool lib = tag->lib_policy != config.lib_policy &&
+        (tag->lib_policy == LIB_KEEP ||
+         (tag->lib_policy == LIB_BUCKET && config.lib_policy == LIB_EXCLUDE));
+    bool tiny = tag->min_insns < config.min_insns;
+    if (!lib && !tiny)
+        return;
+
+    std::vector<fhist_t> functions;
+    fhist_t lib_bucket;
+    fhist_t tiny_bucket;
+    for (size_t k=0; k<tag->functions.size(); k++) {
+        auto &f = tag->functions[k];
+        auto &name = names[k];
+        if (lib && (name == bintag_lib_bucket_name || library.count(name) != 0)) {
+            if (config.lib_policy == LIB_BUCKET)
+                add_to_bucket(&lib_bucket, f);
+        } else if (tiny && (name == bintag_tiny_bucket_name ||
+                    (name != bintag_lib_bucket_name && count_instructions(f) < config.min_insns))) {
+            add_to_bucket(&tiny_bucket, f);
+        } else {
+            functions.push_back(std::move(f));
+        }
+    }
+    append_tag_bucket(&functions, &tiny_bucket, table);
+    append_tag_bucket(&functions, &lib_bucket, table);
+    tag->functions = std::move(functions);
+    if (lib)
+        tag->lib_policy = config.lib_policy;
+    if (tiny)
+        tag->min_insns = config.min_insns;
+}
+
+// throws json::exception if mandatory fields are missing or the library
+// policy is unknown, tag_sax_t rejects the same tags
+static tag_t json_to_tag(const json &t, mnemonic_table_t *table = &mnemonics) {
+    tag_t tag;
+    tag.name = t.at("tag").get<std::string>();
+    tag.description = t.at("description").get<std::string>();
+    if (t.contains("arch")) {
+        tag.is_32bit = t["arch"].value("is_32bit", false);
+        tag.is_64bit = t["arch"].value("is_64bit", false);
+    }
+    if (t.contains("library_functions") &&
+            !parse_lib_policy(t["library_functions"].get<std::string>(), &tag.lib_policy))
+        throw json::other_error::create(599, "unknown library_functions policy");
+    tag.min_insns = t.value("min_instructions", 0u);
+    if (t.contains("imports"))
+        tag.imports = t["imports"].get<std::vector<std::string> >();
+    tag.import_hashes = hash_set(tag.imports);
+    tag.import_minhash = minhash_imports(tag.import_hashes);
+    tag.import_bloom = bloom_imports(tag.import_hashes);
+    if (t.contains("string_hashes")) {
+        tag.string_hashes = t["string_hashes"].get<std::vector<uint64_t> >();
+        sort_hashes(&tag.string_hashes);
+    }
+    tag.functions = histogram_to_vectors(t.at("histogram"), table);
+    std::vector<std::string> names;
+    for (auto &[fname, fhist] : t.at("histogram").items())
+        names.push_back(fname);
+    std::set<std::string> library;
+    if (t.contains("library"))
+        library = t["library"].get<std::set<std::string> >();
+    adapt_tag(&tag, names, library, *table);
+    tag.sizes = function_sizes(tag.functions);
+    return tag;
+}
+
+// Streaming parser building a tag_t directly from a tag file, without the
+// json DOM. Unknown keys are skipped, so tags may carry additional fields.
+class tag_sax_t : public nlohmann::json_sax<json> {
+    enum context_t { ROOT, ARCH, IMPORTS, STRING_HASHES, LIBRARY, HISTOGRAM, FUNCTION, SKIP };
+
+    tag_t *tag;
+    mnemonic_table_t *table;
+    std::vector<context_t> stack;
+    std::string key_;
+    bool has_name = false;
+    bool has_description = false;
+    bool has_histogram = false;
+
+    context_t context() const {
+        return stack.empty() ? ROOT : stack.back();
+    }
+
+    bool count(uint64_t v) {
+        if (context() == ROOT && key_ == "min_instructions")
+            tag->min_insns = uint32_t(std::min<uint64_t>(v, std::numeric_limits<uint32_t>::max()));
+        if (context() != FUNCTION)
+            return true;
+        if (v > std::numeric_limits<uint32_t>::max())
+            return false;
+        tag->functions.back().counts.push_back({table->intern(key_), uint32_t(v)});
+        return true;
+    }
+
+    bool enter(bool is_object) {
+        if (context() == FUNCTION)
+            return false;
+        context_t next = SKIP;
+        if (stack.empty())
+            next = is_object ? ROOT : SKIP;
+        else if (context() == ROOT && is_object && key_ == "arch")
+            next = ARCH;
+        else if (context() == ROOT && !is_object && key_ == "imports")
+            next = IMPORTS;
+        else if (context() == ROOT && !is_object && key_ == "string_hashes")
+            next = STRING_HASHES;
+        else if (context() == ROOT && !is_object && key_ == "library")
+            next = LIBRARY;
+        else if (context() == ROOT && is_object && key_ == "histogram")
+            next = HISTOGRAM;
+        else if (context() == HISTOGRAM && is_object) {
+            tag->functions.emplace_back();
+            names.push_back(key_);
+            next = FUNCTION;
+        }
+        if (next == HISTOGRAM)
+            has_histogram = true;
+        stack.push_back(next);
+        return !(stack.size() == 1 && next == SKIP);
+    }
+
+    bool leave() {
+        if (context() == FUNCTION) {
+            finalize_fhist(&tag->functions.back());
+            sketch_fhist(&tag->functions.back(), *table);
+        }
+        stack.pop_back();
+        return true;
+    }
+
+public:
+    std::vector<std::string> names;     // function names of the rows
+    std::set<std::string> library;      // library and thunk functions
+
+    tag_sax_t(tag_t *tag, mnemonic_table_t *table) : tag(tag), table(table) {}
+
+    bool complete() const {
+        return has_name && has_description && has_histogram;
+    }
+
+    bool null() override { return context() != FUNCTION; }
+    bool boolean(bool val) override {
+        if (context() == ARCH && key_ == "is_32bit")
+            tag->is_32bit = val;
+        else if (context() == ARCH && key_ == "is_64bit")
+            tag->is_64bit = val;
+        return context() != FUNCTION;
+    }
+    bool number_integer(number_integer_t val) override {
+        return val >= 0 ? count(uint64_t(val)) : context() != FUNCTION;
+    }
+    bool number_unsigned(number_unsigned_t val) override {
+        if (context() == STRING_HASHES) {
+            // sorted by parse_tag()
+            tag->string_hashes.push_back(val);
+            return true;
+        }
+        return count(val);
+    }
+    bool number_float(number_float_t val, const string_t &) override {
+        if (!(val >= 0))
+            return context() != FUNCTION;
+        // converting values beyond the range of uint64_t is undefined, clamp
+        // to the first value count() rejects
+        constexpr number_float_t limit = number_float_t(std::numeric_limits<uint32_t>::max()) + 1;
+        return count(uint64_t(std::min(val, limit)));
+    }
+    bool string(string_t &val) override {
+        if (context() == ROOT && key_ == "tag") {
+            tag->name = std::move(val);
+            has_name = true;
+        } else if (context() == ROOT && key_ == "description") {
+            tag->description = std::move(val);
+            has_description = true;
+        } else if (context() == ROOT && key_ == "library_functions") {
+            return parse_lib_policy(val, &tag->lib_policy);
+        } else if (context() == IMPORTS) {
+            tag->imports.push_back(std::move(val));
+        } else if (context() == LIBRARY) {
+            library.insert(std::move(val));
+        }
+        return context() != FUNCTION;
+    }
+    bool start_object(std::size_t) override { return enter(true); }
+    bool key(string_t &val) override { key_ = std::move(val); return true; }
+    bool end_object() override { return leave(); }
+    bool start_array(std::size_t) override { return enter(false); }
+    bool end_array() override { return leave(); }
+    bool parse_error(std::size_t, const std::string &, const nlohmann::detail::exception &) override {
+        return false;
+    }
+};
+
+// maps mnemonic ids of a table private to a loader thread to interned ids
+static std::vector<uint32_t> intern_mnemonics(const std::vector<std::string> &names) {
+    std::vector<uint32_t> ids;
+    ids.reserve(names.size());
+    for (auto &mnem : names)
+        ids.push_back(mnemonics.intern(mnem));
+    return ids;
+}
+
+static void remap_mnemonics(std::vector<fhist_t> *functions, const std::vector<uint32_t> &ids) {
+    for (auto &f : *functions) {
+        for (auto &[id, count] : f.counts)
+            id = ids.at(id);
+        std::sort(f.counts.begin(), f.counts.end());
+    }
+}
+
+/*
+ * =====================================================================================
+ * cache of preprocessed tags
+ * =====================================================================================
+ */
+
+template<typename T>
+static void write_pod(std::ostream &o, const T &v) {
+    o.write(reinterpret_cast<const char *>(&v), sizeof(T));
+}
+
+template<typename T>
+static T read_pod(std::istream &i) {
+    T v;
+    if (!i.read(reinterpret_cast<char *>(&v), sizeof(T)))
+        throw std::runtime_error("truncated cache");
+    return v;
+}
+
+static void write_str(std::ostream &o, const std::string &str) {
+    write_pod<uint32_t>(o, str.size());
+    o.write(str.data(), str.size());
+}
+
+static std::string read_str(std::istream &i) {
+    std::string str(read_pod<uint32_t>(i), '\0');
+    if (!i.read(str.data(), str.size()))
+        throw std::runtime_error("truncated cache");
+    return str;
+}
+
+// ids maps the interned ids to the mnemonic ids used in the stream
+static void write_fhists(std::ostream &o, const std::vector<fhist_t> &functions,
+        const std::vector<uint32_t> *ids = NULL) {
+    write_pod<uint32_t>(o, functions.size());
+    for (auto &f : functions) {
+        write_pod<uint32_t>(o, f.counts.size());
+        for (auto &[id, count] : f.counts) {
+            write_pod<uint32_t>(o, ids != NULL ? ids->at(id) : id);
+            write_pod<uint32_t>(o, count);
+        }
+        write_pod<double>(o, f.sqnorm);
+        write_pod<uint64_t>(o, f.sketch);
+    }
+}
+
+// ids maps the mnemonic ids used in the stream to interned ids
+static std::vector<fhist_t> read_fhists(std::istream &i, const std::vector<uint32_t> &ids) {
+    std::vector<fhist_t> functions(read_pod<uint32_t>(i));
+    for (auto &f : functions) {
+        f.counts.resize(read_pod<uint32_t>(i));
+        for (auto &[id, count] : f.counts) {
+            id = ids.at(read_pod<uint32_t>(i));
+            count = read_pod<uint32_t>(i);
+        }
+        std::sort(f.counts.begin(), f.counts.end());
+        f.sqnorm = read_pod<double>(i);
+        f.sketch = read_pod<uint64_t>(i);
+    }
+    return functions;
+}
+
+static void write_mnemonics(std::ostream &o) {
+    write_pod<uint32_t>(o, mnemonics.names.size());
+    for (auto &mnem : mnemonics.names)
+        write_str(o, mnem);
+}
+
+static std::vector<uint32_t> read_mnemonics(std::istream &i) {
+    std::vector<std::string> names(read_pod<uint32_t>(i));
+    for (auto &mnem : names)
+        mnem = read_str(i);
+    return intern_mnemonics(names);
+}
+
+static void write_tag(std::ostream &o, const tag_t &tag, const std::vector<uint32_t> &ids) {
+    write_str(o, tag.name);
+    write_str(o, tag.description);
+    write_pod<uint8_t>(o, tag.is_32bit);
+    write_pod<uint8_t>(o, tag.is_64bit);
+    write_pod<uint8_t>(o, tag.lib_policy);
+    write_pod<uint32_t>(o, tag.min_insns);
+    write_pod<uint32_t>(o, tag.imports.size());
+    for (auto &import : tag.imports)
+        write_str(o, import);
+    for (auto *hashes : {&tag.import_hashes, &tag.import_minhash, &tag.import_bloom, &tag.string_hashes}) {
+        write_pod<uint32_t>(o, hashes->size());
+        for (auto h : *hashes)
+            write_pod<uint64_t>(o, h);
+    }
+    write_pod<uint32_t>(o, tag.sizes.size());
+    for (auto n : tag.sizes)
+        write_pod<uint32_t>(o, n);
+    write_fhists(o, tag.functions, &ids);
+}
+
+static tag_t read_tag(std::istream &i, const std::vector<uint32_t> &ids) {
+    tag_t tag;
+    tag.name = read_str(i);
+    tag.description = read_str(i);
+    tag.is_32bit = read_pod<uint8_t>(i);
+    tag.is_64bit = read_pod<uint8_t>(i);
+    tag.lib_policy = lib_policy_t(read_pod<uint8_t>(i));
+    tag.min_insns = read_pod<uint32_t>(i);
+    tag.imports.resize(read_pod<uint32_t>(i));
+    for (auto &import : tag.imports)
+        import = read_str(i);
+    for (auto *hashes : {&tag.import_hashes, &tag.import_minhash, &tag.import_bloom, &tag.string_hashes}) {
+        hashes->resize(read_pod<uint32_t>(i));
+        for (auto &h : *hashes)
+            h = read_pod<uint64_t>(i);
+    }
+    tag.sizes.resize(read_pod<uint32_t>(i));
+    for (auto &n : tag.sizes)
+        n = read_pod<uint32_t>(i);
+    tag.functions = read_fhists(i, ids);
+    return tag;
+}
 
-    if (!(fs::exists(tag_dir) && fs::is_directory(tag_dir))) {
-        msg("BinTag [WARNING]: the tag directory %s does not exist!\n", tag_dir.c_str());
-        return std::list<json>();
+static fs::path get_cache_file() {
+    return get_config_dir() / bintag_cache;
+}
+
+// flock on a separate file, the cache itself is replaced by rewrites
+struct cache_lock_t {
+    int fd;
+    explicit cache_lock_t(int op) {
+        auto lock_file = get_config_dir() / bintag_cache_lock;
+        fd = open(lock_file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0 && flock(fd, op) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    ~cache_lock_t() {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+static bool read_cache_header(std::istream &i) {
+    char magic[sizeof(bintag_cache_magic)-1];
+    return i.read(magic, sizeof(magic)) &&
+        std::string(magic, sizeof(magic)) == bintag_cache_magic &&
+        read_pod<uint32_t>(i) == bintag_cache_version &&
+        read_pod<uint8_t>(i) == config.lib_policy &&
+        read_pod<uint32_t>(i) == config.min_insns;
+}
+
+// Reads records up to the end of the log and returns their number. The
+// records only update the corpus if apply is set, ids collects the interned
+// ids of the mnemonic names recorded.
+static size_t read_cache_records(std::istream &i, std::vector<uint32_t> *ids, bool apply) {
+    size_t records = 0;
+    for (char kind; i.get(kind); ) {
+        if (kind == bintag_cache_mnemonics) {
+            auto more = read_mnemonics(i);
+            ids->insert(ids->end(), more.begin(), more.end());
+            continue;
+        }
+        auto path = read_str(i);
+        if (kind == bintag_cache_erase) {
+            if (apply)
+                corpus.erase(path);
+        } else if (kind == bintag_cache_put) {
+            tag_entry_t e;
+            e.size = read_pod<uint64_t>(i);
+            e.mtime = fs::file_time_type(fs::file_time_type::duration(read_pod<int64_t>(i)));
+            e.tag = read_tag(i, *ids);
+            if (apply)
+                corpus[path] = std::move(e);
+        } else {
+            throw std::runtime_error("unknown record");
+        }
+        records++;
+    }
+    return records;
+}
+
+// Fills the corpus from the cache file by replaying its records. A missing,
+// outdated or broken cache leaves the corpus empty, all tags are parsed from
+// the tag directory then.
+static void load_cache() {
+    auto cache_file = get_cache_file();
+    cache_lock_t lock(LOCK_SH);
+    std::ifstream i(cache_file, std::ios::binary);
+    struct stat st;
+    if (!i || stat(cache_file.c_str(), &st) != 0)
+        return;
+
+    std::vector<uint32_t> ids;
+    size_t records = 0;
+    try {
+        if (!read_cache_header(i))
+            return;
+        records = read_cache_records(i, &ids, true);
+    } catch (std::exception &e) {
+        msg("BinTag [WARNING]: ignoring broken cache %s\n", cache_file.c_str());
+        corpus.clear();
+        return;
+    }
+
+    cache_size = st.st_size;
+    cache_inode = st.st_ino;
+    cache_rewrite = false;
+    cache_records = records;
+    cache_ids = std::move(ids);
+    msg("BinTag [INFO]: %zu tags read from cache %s\n", corpus.size(), cache_file.c_str());
+}
+
+// Skips the records another session appended to the log since it was last
+// read or written, or all of them if that session replaced the log. They are
+// left in the log, only their mnemonic names are needed to append to it.
+static bool replay_cache(const fs::path &cache_file, bool replaced) {
+    std::ifstream i(cache_file, std::ios::binary);
+    try {
+        if (replaced) {
+            if (!read_cache_header(i))
+                return false;
+            cache_ids.clear();
+            cache_records = 0;
+        } else if (!i.seekg(cache_size)) {
+            return false;
+        }
+        cache_records += read_cache_records(i, &cache_ids, false);
+    } catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
+static bool cache_dirty() {
+    return cache_rewrite || !cache_changes.empty();
+}
+
+// Writes the mnemonic names missing from the log and returns the mnemonic
+// ids of the log by interned id.
+static std::vector<uint32_t> write_cache_mnemonics(std::ostream &o) {
+    std::vector<uint32_t> ids(mnemonics.names.size(), std::numeric_limits<uint32_t>::max());
+    for (size_t k=0; k<cache_ids.size(); k++)
+        ids[cache_ids[k]] = k;
+    std::vector<uint32_t> missing;
+    for (uint32_t id=0; id<ids.size(); id++) {
+        if (ids[id] == std::numeric_limits<uint32_t>::max())
+            missing.push_back(id);
+    }
+    if (missing.empty())
+        return ids;
+    write_pod<uint8_t>(o, bintag_cache_mnemonics);
+    write_pod<uint32_t>(o, missing.size());
+    for (auto id : missing) {
+        write_str(o, mnemonics.names[id]);
+        ids[id] = cache_ids.size();
+        cache_ids.push_back(id);
+    }
+    return ids;
+}
+
+static void write_cache_record(std::ostream &o, const std::string &path, const std::vector<uint32_t> &ids) {
+    auto it = corpus.find(path);
+    if (it == corpus.end()) {
+        write_pod<uint8_t>(o, bintag_cache_erase);
+        write_str(o, path);
+        return;
+    }
+    write_pod<uint8_t>(o, bintag_cache_put);
+    write_str(o, path);
+    write_pod<uint64_t>(o, it->second.size);
+    write_pod<int64_t>(o, it->second.mtime.time_since_epoch().count());
+    write_tag(o, it->second.tag, ids);
+}
+
+// Writes all tags to a new cache file replacing the log.
+static bool rewrite_cache(const fs::path &cache_file) {
+    std::string tmp_file = cache_file.string() + ".XXXXXX";
+    int fd = mkstemp(tmp_file.data());
+    if (fd < 0)
+        return false;
+    close(fd);
+
+    std::ofstream o(tmp_file, std::ios::binary | std::ios::trunc);
+    o.write(bintag_cache_magic, sizeof(bintag_cache_magic)-1);
+    write_pod<uint32_t>(o, bintag_cache_version);
+    write_pod<uint8_t>(o, config.lib_policy);   // tags are adapted to both
+    write_pod<uint32_t>(o, config.min_insns);
+    cache_ids.clear();
+    auto ids = write_cache_mnemonics(o);
+    for (auto &[path, e] : corpus)
+        write_cache_record(o, path, ids);
+    o.close();
+
+    std::error_code ec;
+    if (o)
+        fs::rename(tmp_file, cache_file, ec);
+    if (!o || ec) {
+        fs::remove(tmp_file, ec);
+        return false;
     }
+    cache_records = corpus.size();
+    return true;
+}
+
+// Appends the tags changed since the last store to the log, so the cost of
+// adding a tag does not depend on the size of the corpus.
+static bool append_cache(const fs::path &cache_file) {
+    std::ofstream o(cache_file, std::ios::binary | std::ios::app);
+    auto ids = write_cache_mnemonics(o);
+    for (auto &path : cache_changes)
+        write_cache_record(o, path, ids);
+    o.close();
+    if (!o)
+        return false;
+    cache_records += cache_changes.size();
+    return true;
+}
+
+// The lock is held from the check of the log to the end of the write, so
+// sessions storing at the same time append after each other.
+static void store_cache() {
+    auto cache_file = get_cache_file();
+    if (!fs::is_directory(cache_file.parent_path()))
+        return;
+    cache_lock_t lock(LOCK_EX);
+    if (lock.fd < 0) {
+        msg("BinTag [WARNING]: could not lock cache %s\n", cache_file.c_str());
+        return;
+    }
+
+    // records appended by another session in the meantime are kept
+    struct stat st;
+    bool compact = cache_rewrite || stat(cache_file.c_str(), &st) != 0;
+    bool replaced = !compact && st.st_ino != cache_inode;
+    if (!compact && (replaced || uintmax_t(st.st_size) != cache_size))
+        compact = (!replaced && uintmax_t(st.st_size) < cache_size) || !replay_cache(cache_file, replaced);
+    compact = compact || cache_records + cache_changes.size() > 2*corpus.size() + bintag_cache_slack;
+    bool ok = compact ? rewrite_cache(cache_file) : append_cache(cache_file);
+    if (ok)
+        ok = stat(cache_file.c_str(), &st) == 0;
+    if (!ok) {
+        // a partial append is detected as broken cache on the next load
+        msg("BinTag [WARNING]: could not write cache %s\n", cache_file.c_str());
+        cache_rewrite = true;
+        return;
+    }
+    cache_size = st.st_size;
+    cache_inode = st.st_ino;
+    cache_changes.clear();
+    cache_rewrite = false;
+}
+
+static bool stat_tag(const fs::path &p, tag_entry_t *e) {
+    std::error_code ec;
+    e->size = fs::file_size(p, ec);
+    if (ec)
+        return false;
+    e->mtime = fs::last_write_time(p, ec);
+    return !ec;
+}
+
+// temporary file store_tag() writes a tag to before renaming it into place,
+// hidden so it can not clash with a tag name
+static fs::path get_tag_tmp_file(const fs::path &tag_file) {
+    return tag_file.parent_path() / ("." + tag_file.filename().string() + ".tmp");
+}
+
+static bool is_tag_file(const fs::path &p) {
+    auto name = p.filename().string();
+    return !(name.size() > 5 && name[0] == '.' && p.extension() == ".tmp");
+}
+
+// tag parsed by a loader thread, mnemonic ids refer to the private table
+struct parsed_tag_t {
+    fs::path path;
+    tag_entry_t entry;
+    mnemonic_table_t mnemonics;
+    bool ok;
+    parsed_tag_t() : ok(false) {}
+};
+
+// Runs on loader threads and therefore must not touch any global state.
+static void parse_tag(parsed_tag_t *parsed) {
+    std::ifstream i(parsed->path);
+    tag_sax_t sax(&parsed->entry.tag, &parsed->mnemonics);
+    parsed->ok = i &&
+        json::sax_parse(i, &sax) &&
+        sax.complete() &&
+        parsed->entry.tag.functions.size() != 0;
+    if (parsed->ok) {
+        auto &tag = parsed->entry.tag;
+        adapt_tag(&tag, sax.names, sax.library, parsed->mnemonics);
+        tag.import_hashes = hash_set(tag.imports);
+        tag.import_minhash = minhash_imports(tag.import_hashes);
+        tag.import_bloom = bloom_imports(tag.import_hashes);
+        sort_hashes(&tag.string_hashes);
+        tag.sizes = function_sizes(tag.functions);
+    }
+}
+
+// Parses the given tags on a pool of loader threads. The results are merged
+// into the corpus in the order of the input, so mnemonic ids are assigned
+// deterministically no matter which thread finished first.
+static void parse_tags(std::vector<parsed_tag_t> *parsed) {
+    parallel_for(parsed->size(), [parsed](size_t k) {
+        parse_tag(&(*parsed)[k]);
+    });
+
+    for (auto &p : *parsed) {
+        msg("BinTag [INFO]: loading tag %s\n", p.path.c_str());
+        if (p.ok) {
+            remap_mnemonics(&p.entry.tag.functions, intern_mnemonics(p.mnemonics.names));
+            corpus[p.path.string()] = std::move(p.entry);
+        } else {
+            msg("BinTag [WARNING]: could not load tag %s\n", p.path.c_str());
+            corpus.erase(p.path.string());
+        }
+        cache_changes.insert(p.path.string());
+    }
+}
+
+// Re-reads the given tag files if they changed, files which are gone are
+// removed from the corpus.
+static void reload_tags(const std::vector<fs::path> &paths) {
+    std::vector<parsed_tag_t> parsed;
+    for (auto &p : paths) {
+        tag_entry_t e;
+        if (!fs::is_regular_file(p) || !stat_tag(p, &e)) {
+            if (corpus.erase(p.string()) != 0) {
+                msg("BinTag [INFO]: removed tag %s\n", p.c_str());
+                cache_changes.insert(p.string());
+            }
+            continue;
+        }
+
+        auto it = corpus.find(p.string());
+        if (it != corpus.end() &&
+                it->second.size == e.size &&
+                it->second.mtime == e.mtime)
+            continue;
+        parsed.emplace_back();
+        parsed.back().path = p;
+        parsed.back().entry.size = e.size;
+        parsed.back().entry.mtime = e.mtime;
+    }
+    parse_tags(&parsed);
+}
+
+/*
+ * =====================================================================================
+ * watcher keeping the corpus in sync with the tag directory
+ * =====================================================================================
+ */
+
+// Runs on the watcher thread. Changed tag files are only recorded here, the
+// corpus itself is updated on the main thread by apply_tag_updates().
+static void watch_tags(int fd, int stop_fd) {
+    alignas(struct inotify_event) char buf[4096];
+    struct pollfd fds[2] = {{fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents != 0)
+            break;
+
+        auto len = read(fd, buf, sizeof(buf));
+        if (len <= 0)
+            continue;
+
+        std::lock_guard<std::mutex> lock(tag_updates_lock);
+        for (char *ptr = buf; ptr < buf + len; ) {
+            auto *event = reinterpret_cast<struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (event->mask & (IN_Q_OVERFLOW | IN_IGNORED)) {
+                // events were lost or the directory is gone, fall back to a scan
+                tag_rescan = true;
+                continue;
+            }
+            if (event->len == 0 || !is_tag_file(event->name))
+                continue;
+            tag_updates.insert(event->name);
+        }
+    }
+}
+
+static void stop_watcher() {
+    if (!watcher.joinable())
+        return;
+    uint64_t one = 1;
+    if (write(watch_stop_fd, &one, sizeof(one)) != sizeof(one))
+        msg("BinTag [WARNING]: could not signal the tag watcher\n");
+    watcher.join();
+    close(watch_fd);
+    close(watch_stop_fd);
+    watch_fd = -1;
+    watch_stop_fd = -1;
+}
+
+static bool start_watcher(const fs::path &tag_dir) {
+    stop_watcher();
+    tag_rescan = false;
+    tag_updates.clear();
+
+    watch_fd = inotify_init1(IN_CLOEXEC);
+    watch_stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (watch_fd < 0 || watch_stop_fd < 0 ||
+            inotify_add_watch(watch_fd, tag_dir.c_str(),
+                IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF) < 0) {
+        msg("BinTag [WARNING]: cannot watch %s, tags are rescanned on each run\n", tag_dir.c_str());
+        if (watch_fd >= 0)
+            close(watch_fd);
+        if (watch_stop_fd >= 0)
+            close(watch_stop_fd);
+        watch_fd = -1;
+        watch_stop_fd = -1;
+        return false;
+    }
+    watcher = std::thread(watch_tags, watch_fd, watch_stop_fd);
+    return true;
+}
+
+// Applies the changes recorded by the watcher. Returns false if the watcher
+// lost track of the directory and a full scan is required.
+static bool apply_tag_updates(const fs::path &tag_dir) {
+    std::set<std::string> updates;
+    {
+        std::lock_guard<std::mutex> lock(tag_updates_lock);
+        if (tag_rescan)
+            return false;
+        updates.swap(tag_updates);
+    }
+    std::vector<fs::path> paths;
+    for (auto &name : updates)
+        paths.push_back(tag_dir / name);
+    reload_tags(paths);
+    return true;
+}
+
+/*
+ * =====================================================================================
+ * loading of the tag corpus
+ * =====================================================================================
+ */
+
+static void scan_tags(const fs::path &tag_dir) {
     msg("BinTag [INFO]: reading tags from %s\n", tag_dir.c_str());
 
-    std::list<json> tags;
+    std::vector<fs::path> paths;
     for (auto &p: fs::directory_iterator(tag_dir)) {
-        if (!fs::is_regular_file(p))
-            continue;
-        msg("BinTag [INFO]: loading tag %s\n", p.path().c_str());
-        json t;
-        try {
-            std::ifstream i(p.path());
-            i >> t;
-            i.close();
-            if (t["histogram"].size() != 0)
-                tags.push_back(t);
-        } catch (json::exception &e) {
-            msg("BinTag [WARNING]: could not load tag %s\n", p.path().c_str());
+        if (fs::is_regular_file(p) && is_tag_file(p.path()))
+            paths.push_back(p.path());
+    }
+    std::sort(paths.begin(), paths.end());
+
+    std::set<std::string> present;
+    for (auto &p : paths)
+        present.insert(p.string());
+    for (auto it = corpus.begin(); it != corpus.end(); ) {
+        if (present.count(it->first) == 0) {
+            cache_changes.insert(it->first);
+            it = corpus.erase(it);
+        } else {
+            ++it;
         }
     }
 
-    return tags;
+    reload_tags(paths);
+}
+
+// Brings the in-memory corpus up to date with the tag directory. Only tags
+// which are new or whose size or mtime changed since the last call or since
+// the cache was written are parsed. Once the directory is watched only the
+// files reported by the watcher are looked at.
+static const std::map<std::string, tag_entry_t> &load_tags() {
+    auto tag_dir = get_tag_dir();
+
+    if (!corpus_loaded) {
+        load_cache();
+        corpus_loaded = true;
+    }
+
+    if (!watcher.joinable() || !apply_tag_updates(tag_dir)) {
+        if (!(fs::exists(tag_dir) && fs::is_directory(tag_dir))) {
+            msg("BinTag [WARNING]: the tag directory %s does not exist!\n", tag_dir.c_str());
+            stop_watcher();
+            cache_rewrite = cache_rewrite || !corpus.empty();
+            corpus.clear();
+            return corpus;
+        }
+        // watch first, changes made during the scan are picked up next time
+        start_watcher(tag_dir);
+        scan_tags(tag_dir);
+    }
+
+    if (cache_dirty())
+        store_cache();
+
+    return corpus;
+}
+
+// Writes a single tag next to its final location and renames it into place,
+// so readers never observe a partially written tag. The tag is added to the
+// in-memory corpus right away.
+static bool store_tag(const fs::path &tag_file, const json &tag) {
+    auto tmp_file = get_tag_tmp_file(tag_file);
+    std::ofstream o(tmp_file.c_str());
+    // names and imports are not necessarily valid utf-8
+    o << tag.dump(-1, ' ', false, json::error_handler_t::replace) << std::endl;
+    o.close();
+    if (!o) {
+        msg("BinTag [ERROR]: could not write %s\n", tmp_file.c_str());
+        return false;
+    }
+
+    std::error_code ec;
+    fs::rename(tmp_file, tag_file, ec);
+    if (ec) {
+        msg("BinTag [ERROR]: could not write %s\n", tag_file.c_str());
+        fs::remove(tmp_file, ec);
+        return false;
+    }
+
+    tag_entry_t e;
+    if (stat_tag(tag_file, &e)) {
+        try {
+            e.tag = json_to_tag(tag);
+            corpus[tag_file.string()] = std::move(e);
+        } catch (json::exception &ex) {
+            msg("BinTag [WARNING]: could not load tag %s: %s\n", tag_file.c_str(), ex.what());
+            corpus.erase(tag_file.string());
+        }
+        cache_changes.insert(tag_file.string());
+    }
+    return true;
 }
 
 /*
@@ -198,68 +1660,425 @@ static std::list<json> load_tags() {
  * =====================================================================================
  */
 
-static void get_mnemonics(ea_t start_ea, ea_t end_ea, qlist<qstring> *mnemonics) {
-    ea_t ea = start_ea;
-    do {
+// Decodes all instructions of a function including its tail chunks. Items
+// are walked like IDAPython's FuncItems() does, only code heads are decoded
+// and data embedded in the function is skipped.
+static void decode_function(func_t *pfn, func_insns_t *insns) {
+    func_item_iterator_t fii;
+    for (bool ok = fii.set(pfn); ok; ok = fii.next_code()) {
+        ea_t ea = fii.current();
+        if (!is_code(get_flags(ea)))
+            continue;
         insn_t insn;
-        decode_insn(&insn, ea);
-        qstring mnem = insn.get_canon_mnem();
-        mnemonics->push_back(mnem);
-        ea += insn.size;
-        if (insn.size == 0)
+        if (decode_insn(&insn, ea) <= 0)
+            continue;
+        itypes.add(insn);
+        insns->itypes.push_back(insn.itype);
+    }
+}
+
+// Returns the decoded instructions of a function. Every function is decoded
+// only once per session, all feature extraction passes read from here.
+static const func_insns_t &get_func_insns(func_t *pfn) {
+    auto [it, inserted] = insn_cache.try_emplace(pfn->start_ea);
+    if (inserted)
+        decode_function(pfn, &it->second);
+    return it->second;
+}
+
+static bool is_lib_function(const func_t *pfn) {
+    return (pfn->flags & (FUNC_LIB | FUNC_THUNK)) != 0;
+}
+
+// Returns the row a function is counted in: its own entry address, one of
+// the bucket addresses or BADADDR if it is left out. Functions without any
+// code are always left out, they would only add degenerate pairs to the
+// comparison.
+static ea_t classify_function(const sample_hist_t &h, const func_t *pfn, const func_insns_t &insns) {
+    if (insns.itypes.empty())
+        return BADADDR;
+    if (h.lib_policy != LIB_KEEP && is_lib_function(pfn))
+        return h.lib_policy == LIB_BUCKET ? bintag_lib_bucket_ea : BADADDR;
+    if (insns.itypes.size() < h.min_insns)
+        return bintag_tiny_bucket_ea;
+    return pfn->start_ea;
+}
+
+static bool has_buckets(const sample_hist_t &h) {
+    return h.lib_policy == LIB_BUCKET || h.min_insns > 1;
+}
+
+static void count_function(const func_insns_t &insns, mnemonic_counter_t *counter, fhist_t *f) {
+    for (auto itype : insns.itypes)
+        counter->add(itypes[itype]);
+    counter->flush(f);
+    finalize_fhist(f);
+    sketch_fhist(f, mnemonics);
+}
+
+static void add_bucket_counts(sample_hist_t *h, ea_t bucket, const fhist_t &f) {
+    auto &counts = h->bucket_counts[bucket];
+    for (auto &[id, count] : f.counts) {
+        if (id >= counts.size())
+            counts.resize(id + 1, 0);
+        counts[id] += count;
+    }
+}
+
+static void add_bucket_member(sample_hist_t *h, ea_t bucket, ea_t ea, const func_insns_t &insns,
+        mnemonic_counter_t *counter) {
+    auto &m = h->members[ea];
+    m.bucket = bucket;
+    for (auto itype : insns.itypes)
+        counter->add(itypes[itype]);
+    counter->flush(&m.counts);
+    finalize_fhist(&m.counts);
+    add_bucket_counts(h, bucket, m.counts);
+}
+
+static void remove_bucket_member(sample_hist_t *h, ea_t ea) {
+    auto it = h->members.find(ea);
+    if (it == h->members.end())
+        return;
+    auto &counts = h->bucket_counts[it->second.bucket];
+    for (auto &[id, count] : it->second.counts.counts)
+        counts[id] -= count;
+    h->members.erase(it);
+}
+
+// appends the pseudo function of a bucket made of its summed counts
+static void append_bucket(sample_hist_t *h, ea_t bucket) {
+    auto it = h->bucket_counts.find(bucket);
+    if (it == h->bucket_counts.end())
+        return;
+    fhist_t f;
+    for (uint32_t id=0; id<it->second.size(); id++) {
+        if (it->second[id] != 0)
+            f.counts.push_back({id, uint32_t(std::min<uint64_t>(it->second[id], std::numeric_limits<uint32_t>::max()))});
+    }
+    if (f.counts.empty())
+        return;
+    finalize_fhist(&f);
+    sketch_fhist(&f, mnemonics);
+    h->eas.push_back(bucket);
+    h->functions.push_back(std::move(f));
+}
+
+// Functions are decoded and counted on the main thread. The ida kernel may
+// not be called from other threads and this tree has no standalone decoder,
+// so decoding, the only expensive step, can not be spread over cores; it is
+// done once per function and session by get_func_insns(). Library and thunk
+// functions and functions with fewer than min_insns instructions are handled
+// as configured.
+static sample_hist_t get_mnem_histogram(lib_policy_t lib_policy, uint32_t min_insns) {
+    sample_hist_t h;
+    h.lib_policy = lib_policy;
+    h.min_insns = min_insns;
+
+    std::vector<const func_insns_t *> insns;
+    mnemonic_counter_t counter;
+    size_t qty = get_func_qty();
+    for (size_t k=0; k<qty; k++) {
+        func_t *pfn = getn_func(k);
+        if (pfn == NULL)
+            continue;
+        if (k % 256 == 0)
+            show_addr(pfn->start_ea);
+
+        auto &fi = get_func_insns(pfn);
+        ea_t row = classify_function(h, pfn, fi);
+        if (row == pfn->start_ea) {
+            h.eas.push_back(row);
+            insns.push_back(&fi);
+        } else if (row != BADADDR) {
+            add_bucket_member(&h, row, pfn->start_ea, fi, &counter);
+        }
+
+        if (user_cancelled()) {
+            h.cancelled = true;
             break;
-    } while(ea < end_ea && ea != BADADDR);
+        }
+    }
+
+    h.functions.resize(insns.size());
+    for (size_t k=0; k<insns.size(); k++)
+        count_function(*insns[k], &counter, &h.functions[k]);
+    append_bucket(&h, bintag_tiny_bucket_ea);
+    append_bucket(&h, bintag_lib_bucket_ea);
+
+    return h;
 }
 
-static json get_mnem_histogram() {
-    json h;
-    func_t* fchunk = get_next_fchunk(inf_get_min_ea());
-    do {
-        qlist<qstring> mnemonics;
+// Converts histograms to json. Tags are keyed by function name, names are
+// only resolved here. Mnemonic ids are resolved to their names. The names of
+// library and thunk functions are added to library if given.
+static json histogram_to_json(const sample_hist_t &h, std::vector<std::string> *library = NULL) {
+    json j = json::object();
+    for (size_t k=0; k<h.functions.size(); k++) {
         qstring fname;
+        if (h.eas[k] == bintag_lib_bucket_ea)
+            fname = bintag_lib_bucket_name;
+        else if (h.eas[k] == bintag_tiny_bucket_ea)
+            fname = bintag_tiny_bucket_name;
+        else if (get_func_name(&fname, h.eas[k]) <= 0 ||
+                j.contains(fname.c_str()) ||
+                fname == bintag_lib_bucket_name ||
+                fname == bintag_tiny_bucket_name)
+            fname.sprnt("sub_%a", h.eas[k]);
+        if (library != NULL) {
+            func_t *pfn = get_func(h.eas[k]);
+            if (pfn != NULL && is_lib_function(pfn))
+                library->push_back(fname.c_str());
+        }
+        json &f = j[fname.c_str()];
+        for (auto &[id, count] : h.functions[k].counts)
+            f[mnemonics.names[id]] = count;
+    }
+    return j;
+}
 
-        ea_t start_ea = fchunk->start_ea;
-        ea_t end_ea = fchunk->end_ea;
-        if (start_ea == NULL ||
-                end_ea == NULL)
-            break;
+// Recomputes the histograms of the functions starting at the given addresses.
+// Functions which no longer exist are removed from h. Buckets whose address
+// is given are rebuilt from all functions.
+static void update_mnem_histogram(sample_hist_t *h, const std::set<ea_t> &eas) {
+    std::unordered_map<ea_t, size_t> index;
+    for (size_t k=0; k<h->eas.size(); k++)
+        index.emplace(h->eas[k], k);
+
+    // bucket rows are rebuilt from the counts of their members, changed
+    // members are taken out of them first
+    std::set<ea_t> buckets;
+    for (auto ea : eas) {
+        auto it = h->members.find(ea);
+        if (it != h->members.end()) {
+            buckets.insert(it->second.bucket);
+            remove_bucket_member(h, ea);
+        }
+        if (ea == bintag_lib_bucket_ea || ea == bintag_tiny_bucket_ea)
+            buckets.insert(ea);
+    }
 
-        show_addr(start_ea);
-        get_mnemonics(start_ea, end_ea, &mnemonics);
+    // drop changed functions, the last entry takes the place of a removed one
+    std::vector<size_t> removed;
+    for (auto ea : eas) {
+        auto it = index.find(ea);
+        if (it != index.end())
+            removed.push_back(it->second);
+    }
+    for (auto ea : buckets) {
+        auto it = index.find(ea);
+        if (it != index.end() && eas.count(ea) == 0)
+            removed.push_back(it->second);
+    }
+    std::sort(removed.rbegin(), removed.rend());
+    for (auto k : removed) {
+        h->eas[k] = h->eas.back();
+        h->functions[k] = std::move(h->functions.back());
+        h->eas.pop_back();
+        h->functions.pop_back();
+    }
 
-        get_func_name(&fname, start_ea);
-        for (auto &mnem : mnemonics)
-        {
-            if (h[fname.c_str()].find(mnem.c_str()) != h[fname.c_str()].end())
-                h[fname.c_str()][mnem.c_str()] = h[fname.c_str()][mnem.c_str()].get<unsigned int>() + 1;
-            else
-                h[fname.c_str()][mnem.c_str()] = 1u;
+    // only the changed functions are decoded again
+    mnemonic_counter_t counter;
+    for (auto ea : eas) {
+        func_t *pfn = get_func(ea);
+        if (pfn == NULL || pfn->start_ea != ea)
+            continue;
+
+        auto &insns = get_func_insns(pfn);
+        ea_t row = classify_function(*h, pfn, insns);
+        if (row == ea) {
+            h->eas.push_back(ea);
+            h->functions.emplace_back();
+            count_function(insns, &counter, &h->functions.back());
+        } else if (row != BADADDR) {
+            add_bucket_member(h, row, ea, insns, &counter);
+            buckets.insert(row);
         }
+    }
+
+    for (auto ea : buckets)
+        append_bucket(h, ea);
+}
+
+/*
+ * =====================================================================================
+ * histogram cache in the idb
+ * =====================================================================================
+ */
+
+// The generation counter stored in the idb is increased whenever code or
+// functions change. A cached histogram is only used if it was computed in
+// the current generation. The counter is written once per change set.
+static void invalidate_histogram() {
+    if (generation_changed)
+        return;
+    netnode n(bintag_netnode, 0, true);
+    n.altset(bintag_generation_idx, n.altval(bintag_generation_idx) + 1);
+    generation_changed = true;
+}
+
+static bool load_histogram(sample_hist_t *h) {
+    netnode n(bintag_netnode);
+    if (n == BADNODE)
+        return false;
+    bytevec_t blob;
+    if (n.getblob(&blob, bintag_histogram_idx, bintag_histogram_tag) <= 0)
+        return false;
+
+    try {
+        std::istringstream i(std::string(blob.begin(), blob.end()));
+        if (read_pod<uint32_t>(i) != bintag_histogram_version ||
+                read_pod<uint64_t>(i) != n.altval(bintag_generation_idx) ||
+                read_pod<uint8_t>(i) != h->lib_policy ||
+                read_pod<uint32_t>(i) != h->min_insns)
+            return false;
+        auto ids = read_mnemonics(i);
+        h->eas.resize(read_pod<uint32_t>(i));
+        for (auto &ea : h->eas)
+            ea = read_pod<uint64_t>(i);
+        h->functions = read_fhists(i, ids);
+        if (h->functions.size() != h->eas.size())
+            return false;
+        std::vector<std::pair<ea_t, ea_t> > members(read_pod<uint32_t>(i));
+        for (auto &[ea, bucket] : members) {
+            ea = read_pod<uint64_t>(i);
+            bucket = read_pod<uint64_t>(i);
+        }
+        auto counts = read_fhists(i, ids);
+        if (counts.size() != members.size())
+            return false;
+        for (size_t k=0; k<members.size(); k++) {
+            auto &m = h->members[members[k].first];
+            m.bucket = members[k].second;
+            m.counts = std::move(counts[k]);
+            add_bucket_counts(h, m.bucket, m.counts);
+        }
+    } catch (std::exception &e) {
+        return false;
+    }
+    return true;
+}
+
+static void store_histogram(const sample_hist_t &h) {
+    netnode n(bintag_netnode, 0, true);
+    std::ostringstream o;
+    write_pod<uint32_t>(o, bintag_histogram_version);
+    write_pod<uint64_t>(o, n.altval(bintag_generation_idx));
+    write_pod<uint8_t>(o, h.lib_policy);
+    write_pod<uint32_t>(o, h.min_insns);
+    write_mnemonics(o);
+    write_pod<uint32_t>(o, h.eas.size());
+    for (auto ea : h.eas)
+        write_pod<uint64_t>(o, ea);
+    write_fhists(o, h.functions);
+    std::vector<fhist_t> members;
+    write_pod<uint32_t>(o, h.members.size());
+    for (auto &[ea, m] : h.members) {
+        write_pod<uint64_t>(o, ea);
+        write_pod<uint64_t>(o, m.bucket);
+        members.push_back(m.counts);
+    }
+    write_fhists(o, members);
+    auto blob = o.str();
+    n.setblob(blob.data(), blob.size(), bintag_histogram_idx, bintag_histogram_tag);
+}
+
+// Records a function whose histogram must be recomputed. Tail chunks are
+// accounted to their owner.
+static void mark_function(ea_t ea) {
+    func_t *pfn = get_fchunk(ea);
+    if (pfn == NULL)
+        return;
+    dirty_functions.insert((pfn->flags & FUNC_TAIL) != 0 ? pfn->owner : pfn->start_ea);
+}
+
+static void mark_functions(ea_t start_ea, ea_t end_ea) {
+    mark_function(start_ea);
+    for (func_t *pfn = get_next_fchunk(start_ea);
+            pfn != NULL && pfn->start_ea < end_ea;
+            pfn = get_next_fchunk(pfn->start_ea))
+        mark_function(pfn->start_ea);
+}
 
-        fchunk = get_next_fchunk(end_ea);
+// Returns the histogram of the loaded sample. It is computed once per
+// database, later calls only recompute the functions changed in between.
+static const sample_hist_t &get_sample_histogram() {
+    for (auto ea : dirty_functions)
+        insn_cache.erase(ea);
+
+    if (sample_valid) {
+        bool changed = generation_changed || !dirty_functions.empty();
+        if (!dirty_functions.empty()) {
+            if (has_buckets(sample)) {
+                dirty_functions.insert(bintag_lib_bucket_ea);
+                dirty_functions.insert(bintag_tiny_bucket_ea);
+            }
+            update_mnem_histogram(&sample, dirty_functions);
+            rescore_functions.insert(dirty_functions.begin(), dirty_functions.end());
+            dirty_functions.clear();
+        }
+        // changes outside of functions still raised the generation, the blob
+        // has to carry the new one to stay valid
+        if (changed)
+            store_histogram(sample);
+        generation_changed = false;
+        return sample;
+    }
 
-        if (user_cancelled())
-            break;
-    } while(fchunk != NULL);
+    // changes before the histogram was loaded or computed are contained
+    dirty_functions.clear();
+    rescore_all = true;
+    sample = sample_hist_t();
+    sample.lib_policy = config.lib_policy;
+    sample.min_insns = config.min_insns;
+    if (load_histogram(&sample)) {
+        sample_valid = true;
+        generation_changed = false;
+        return sample;
+    }
 
-    return h;
+    sample = get_mnem_histogram(config.lib_policy, config.min_insns);
+    if (!sample.cancelled) {
+        store_histogram(sample);
+        sample_valid = true;
+        generation_changed = false;
+    }
+    return sample;
 }
 
 // import_enum_cb_t implementation
 static int idaapi import_enum_cb(ea_t ea, const char* name, uval_t ordinal, void* param) {
-    std::list<std::string> *imports = reinterpret_cast<std::list<std::string> *>(param);
+    std::vector<std::string> *imports = reinterpret_cast<std::vector<std::string> *>(param);
     if (name)
         imports->push_back(name);
     return 1;
 }
 
-static std::list<std::string> get_imports() {
-    std::list<std::string> imports;
+static std::vector<std::string> get_imports() {
+    std::vector<std::string> imports;
     for (uint i = 0; i<get_import_module_qty(); i++)
         enum_import_names(i, import_enum_cb, &imports);
     return imports;
 }
 
+// Hashes of the string literals found by the auto analysis as sorted set.
+// Only the hashes are written to tags, which are shared, and only the
+// hashes are compared.
+static std::vector<uint64_t> get_string_hashes() {
+    std::vector<uint64_t> hashes;
+    build_strlist();
+    for (size_t n = 0; n<get_strlist_qty(); n++) {
+        string_info_t si;
+        qstring str;
+        if (get_strlist_item(&si, n) &&
+                get_strlit_contents(&str, si.ea, si.length, si.type) > 0)
+            hashes.push_back(hash_string(str.c_str()));
+    }
+    sort_hashes(&hashes);
+    return hashes;
+}
+
 /*
  * =====================================================================================
  * implementation of the distance computation
@@ -267,162 +2086,701 @@ static std::list<std::string> get_imports() {
  */
 
 inline
-static double calculate_euclidean_function_distance(std::vector<double> f0, std::vector<double> f1) {
-    // euclid distance of vectors
-    double d_f0f1 = 0.0;
-    for (int i=0; i<f0.size(); i++) {
-        d_f0f1 += pow(f0[i] - f1[i], 2.0);
+static double calculate_dot_product(const double *f0, const double *f1, size_t n) {
+    double a = 0.0;
+    for (size_t i=0; i<n; i++) {
+        a += f0[i] * f1[i];
     }
-    return sqrt(d_f0f1);
+    return a;
 }
 
+// products of counts below 2^24 are exact in double, so are their sums
 inline
-static double calculate_cosine_function_distance(std::vector<double> f0, std::vector<double> f1) {
-    //  1 : orthogonal
-    //  0 : same angle
-    double a = 0;
-    int n = f0.size();
-    for (int i=0; i<n; i++) {
-        a += f0[i] * f1[i];
+static double calculate_dot_product(const float *f0, const float *f1, size_t n) {
+    size_t i = 0;
+    double a = 0.0;
+#ifdef __SSE2__
+    __m128d acc = _mm_setzero_pd();
+    for (; i+4<=n; i+=4) {
+        __m128 x = _mm_loadu_ps(f0 + i);
+        __m128 y = _mm_loadu_ps(f1 + i);
+        acc = _mm_add_pd(acc, _mm_mul_pd(_mm_cvtps_pd(x), _mm_cvtps_pd(y)));
+        x = _mm_movehl_ps(x, x);
+        y = _mm_movehl_ps(y, y);
+        acc = _mm_add_pd(acc, _mm_mul_pd(_mm_cvtps_pd(x), _mm_cvtps_pd(y)));
     }
-    if (a == 0) {
-        return 1.0;
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    a = lanes[0] + lanes[1];
+#endif
+    for (; i<n; i++)
+        a += double(f0[i]) * double(f1[i]);
+    return a;
+}
+
+// Dot product of two sorted sparse histograms, linear in their number of
+// mnemonics. Integer arithmetic gives the same result as the dense kernels.
+inline
+static double calculate_sparse_dot_product(const fhist_t &f0, const fhist_t &f1) {
+    uint64_t a = 0;
+    auto i0 = f0.counts.begin();
+    auto i1 = f1.counts.begin();
+    while (i0 != f0.counts.end() && i1 != f1.counts.end()) {
+        if (i0->first < i1->first) {
+            ++i0;
+        } else if (i1->first < i0->first) {
+            ++i1;
+        } else {
+            a += uint64_t(i0->second) * uint64_t(i1->second);
+            ++i0;
+            ++i1;
+        }
+    }
+    return double(a);
+}
+
+#ifdef __SSE2__
+// adds the non-negative 32 bit lanes of v to the 64 bit lanes of acc
+inline
+static __m128i add_epu32_epi64(__m128i acc, __m128i v) {
+    __m128i zero = _mm_setzero_si128();
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+    return _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+}
+
+inline
+static uint64_t sum_epi64(__m128i acc) {
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes), acc);
+    return lanes[0] + lanes[1];
+}
+#endif
+
+// values are at most 2^15-1, so pairwise sums of products fit in 31 bit
+inline
+static double calculate_dot_product(const int16_t *f0, const int16_t *f1, size_t n) {
+    size_t i = 0;
+    uint64_t a = 0;
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for (; i+8<=n; i+=8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(f0 + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(f1 + i));
+        acc = add_epu32_epi64(acc, _mm_madd_epi16(x, y));
     }
+    a = sum_epi64(acc);
+#endif
+    for (; i<n; i++)
+        a += uint64_t(f0[i]) * uint64_t(f1[i]);
+    return double(a);
+}
 
-    double b = 0;
-    for (int i=0; i<n; i++) {
-        b += pow(f0[i], 2.0);
+inline
+static double calculate_dot_product(const uint8_t *f0, const uint8_t *f1, size_t n) {
+    size_t i = 0;
+    uint64_t a = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (; i+16<=n; i+=16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(f0 + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(f1 + i));
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), _mm_unpacklo_epi8(y, zero));
+        __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), _mm_unpackhi_epi8(y, zero));
+        acc = add_epu32_epi64(acc, _mm_add_epi32(lo, hi));
     }
-    b = sqrt(b);
+    a = sum_epi64(acc);
+#endif
+    for (; i<n; i++)
+        a += uint32_t(f0[i]) * uint32_t(f1[i]);
+    return double(a);
+}
+
+inline
+static double calculate_euclidean_function_distance(double a, double sqnorm0, double sqnorm1) {
+    // euclid distance of vectors, |f0 - f1|^2 = |f0|^2 + |f1|^2 - 2 f0.f1
+    double d_f0f1 = sqnorm0 + sqnorm1 - 2.0*a;
+    return (d_f0f1 > 0.0) ? sqrt(d_f0f1) : 0.0;
+}
 
-    double c = 0;
-    for (int i=0; i<n; i++) {
-        c += pow(f1[i], 2.0);
+inline
+static double calculate_cosine_function_distance(double a, double sqnorm0, double sqnorm1) {
+    //  1 : orthogonal
+    //  0 : same angle
+    if (a == 0) {
+        return 1.0;
     }
 
+    // the norm of f1 has always entered squared, keep it for comparable scores
+    double b = sqrt(sqnorm0);
+    double c = sqnorm1;
+
     double cos_phi =  a / (b*c);
     return 1.0 - 2.0*acos(cos_phi) / M_PI;
 }
 
-static std::vector<std::vector<double> > transpose(std::vector<std::vector<double> > M) {
-    unsigned int i = 0;
-    std::vector<std::vector<double> > Mt;
-    Mt.resize(M[0].size());
-    for (auto &r : Mt) {
-        r.resize(M.size());
-    }
-    for (auto &r : M) {
-        unsigned int j = 0;
-        for (auto &d : r) {
-            Mt[j][i] = d;
-            j += 1;
+// builds the index of all mnemonics present in both samples
+static std::unordered_map<uint32_t, uint32_t> build_index(const std::vector<fhist_t> &s0,
+        const std::vector<fhist_t> &s1) {
+    std::unordered_map<uint32_t, uint32_t> index;
+    for (auto *s : {&s0, &s1}) {
+        for (auto &f : *s) {
+            for (auto &[id, count] : f.counts)
+                index.emplace(id, index.size());
         }
-        i += 1;
     }
-    return Mt;
+    return index;
 }
 
-static double calculate_distance(json s0, json s1) {
-    // build list with all mnemonics present in both samples
-    std::list<std::string> mnemonics;
-    for (auto &[f_s0, f_s0_hist] : s0.items()) {
-        for (auto &[f_s0_mnem, f_s0_mnem_count] : f_s0_hist.items()) {
-            if (std::find(mnemonics.begin(), mnemonics.end(), f_s0_mnem) == mnemonics.end())
-                mnemonics.push_back(f_s0_mnem);
+// dense vectors of a set of functions, one row of dim values per function.
+// Integer rows are scaled down if a count exceeds the value range, scale
+// restores the original magnitude. The norms are those of the stored rows,
+// so distances of quantized rows stay consistent.
+template<typename T>
+struct dense_vectors_t {
+    const std::vector<fhist_t> *functions;
+    size_t dim;
+    std::vector<T> values;
+    std::vector<double> scale;
+    std::vector<double> sqnorm;
+
+    const T *row(size_t k) const {
+        return values.data() + k*dim;
+    }
+};
+
+// builds dense vectors over the given mnemonic index
+template<typename T>
+static dense_vectors_t<T> densify(const std::vector<fhist_t> &s,
+        const std::unordered_map<uint32_t, uint32_t> &index) {
+    dense_vectors_t<T> v;
+    v.functions = &s;
+    v.dim = index.size();
+    v.values.assign(s.size() * v.dim, T(0));
+    v.scale.assign(s.size(), 1.0);
+    v.sqnorm.resize(s.size());
+    for (size_t k=0; k<s.size(); k++) {
+        auto &f = s[k];
+        T *row = v.values.data() + k*v.dim;
+        v.sqnorm[k] = f.sqnorm;
+        if constexpr (std::is_integral_v<T>) {
+            uint32_t peak = 0;
+            for (auto &[id, count] : f.counts)
+                peak = std::max(peak, count);
+            if (peak <= uint32_t(std::numeric_limits<T>::max())) {
+                for (auto &[id, count] : f.counts)
+                    row[index.at(id)] = T(count);
+                continue;
+            }
+            double scale = double(peak) / std::numeric_limits<T>::max();
+            double sqnorm = 0.0;
+            for (auto &[id, count] : f.counts) {
+                T q = T(std::lround(count / scale));
+                row[index.at(id)] = q;
+                sqnorm += double(q) * double(q);
+            }
+            v.scale[k] = scale;
+            v.sqnorm[k] = sqnorm * scale * scale;
+        } else {
+            for (auto &[id, count] : f.counts)
+                row[index.at(id)] = T(count);
         }
     }
-    for (auto &[f_s1, f_s1_hist] : s1.items()) {
-        for (auto &[f_s1_mnem, f_s1_mnem_count] : f_s1_hist.items()) {
-            if (std::find(mnemonics.begin(), mnemonics.end(), f_s1_mnem) == mnemonics.end())
-                mnemonics.push_back(f_s1_mnem);
+    return v;
+}
+
+// Pairs of small functions are compared on their sparse histograms, unless a
+// row is quantized and only its stored values are consistent with its norm.
+template<typename T>
+inline
+static double calculate_dot_product(const dense_vectors_t<T> &v0, size_t i,
+        const dense_vectors_t<T> &v1, size_t j) {
+    auto &f0 = (*v0.functions)[i];
+    auto &f1 = (*v1.functions)[j];
+    if ((f0.counts.size() + f1.counts.size()) * bintag_sparse_ratio < v0.dim &&
+            v0.scale[i] == 1.0 && v1.scale[j] == 1.0)
+        return calculate_sparse_dot_product(f0, f1);
+    return calculate_dot_product(v0.row(i), v1.row(j), v0.dim) * v0.scale[i] * v1.scale[j];
+}
+
+template<typename T>
+inline
+static double calculate_function_distance(const dense_vectors_t<T> &v0, size_t i,
+        const dense_vectors_t<T> &v1, size_t j) {
+    double a = calculate_dot_product(v0, i, v1, j);
+    double cosine_distance = calculate_cosine_function_distance(a, v0.sqnorm[i], v1.sqnorm[j]);
+    double euclidean_distance = calculate_euclidean_function_distance(a, v0.sqnorm[i], v1.sqnorm[j]);
+    return cosine_distance * euclidean_distance;
+}
+
+// Estimates the distances of all pairs from the angles between them, which
+// the fraction of differing sketch bits estimates divided by pi, row major.
+// Histograms are non-negative, so they are at most orthogonal; sketches can
+// still differ in more than 32 bits. With the norm of f1 entering squared as
+// in calculate_cosine_function_distance(), the cosine term only depends on
+// the bits and the column and is computed once per combination, a pair
+// costs a popcount and a square root instead of a dot product.
+static std::vector<double> estimate_distances(const std::vector<fhist_t> &s0, const std::vector<fhist_t> &s1) {
+    constexpr int max_bits = 32;
+    static const auto cosines = []() {
+        std::array<double, max_bits+1> c;
+        for (int k=0; k<=max_bits; k++)
+            c[k] = cos(M_PI * k / 64.0);
+        return c;
+    }();
+
+    size_t n1 = s1.size();
+    std::vector<double> norm1(n1);
+    std::vector<double> cosine_distance(n1 * (max_bits+1));
+    for (size_t j=0; j<n1; j++) {
+        norm1[j] = sqrt(s1[j].sqnorm);
+        for (int k=0; k<=max_bits; k++)
+            cosine_distance[j*(max_bits+1) + k] = 1.0 - 2.0*acos(cosines[k] / norm1[j]) / M_PI;
+    }
+
+    std::vector<double> est(s0.size() * n1);
+    for (size_t i=0; i<s0.size(); i++) {
+        double norm0 = sqrt(s0[i].sqnorm);
+        for (size_t j=0; j<n1; j++) {
+            int bits = std::min(__builtin_popcountll(s0[i].sketch ^ s1[j].sketch), max_bits);
+            double a = cosines[bits] * norm0 * norm1[j];
+            est[i*n1 + j] = cosine_distance[j*(max_bits+1) + bits] *
+                calculate_euclidean_function_distance(a, s0[i].sqnorm, s1[j].sqnorm);
         }
     }
-    mnemonics.sort();
+    return est;
+}
+
+// Calls mark(m) for the k smallest of the n estimates est[first + m*stride],
+// for all of them if k >= n.
+template<typename F>
+static void select_smallest(const std::vector<double> &est, size_t first, size_t stride, size_t n, size_t k,
+        std::vector<std::pair<double, size_t> > *buf, F mark) {
+    if (k >= n) {
+        for (size_t m=0; m<n; m++)
+            mark(m);
+        return;
+    }
+    buf->resize(n);
+    for (size_t m=0; m<n; m++)
+        (*buf)[m] = {est[first + m*stride], m};
+    std::nth_element(buf->begin(), buf->begin() + k, buf->end());
+    for (size_t m=0; m<k; m++)
+        mark((*buf)[m].second);
+}
+
+// Marks the pairs of the distance matrix evaluated when pruning with the
+// sketches: the best estimated k pairs of every row and every column. The
+// estimates are computed once for both.
+static std::vector<std::vector<bool> > select_candidate_pairs(const std::vector<fhist_t> &s0,
+        const std::vector<fhist_t> &s1, size_t k) {
+    if (k == 0 || (k >= s0.size() && k >= s1.size()))
+        return std::vector<std::vector<bool> >();
+    auto est = estimate_distances(s0, s1);
+    std::vector<std::vector<bool> > pairs(s0.size(), std::vector<bool>(s1.size(), false));
+    std::vector<std::pair<double, size_t> > buf;
+    for (size_t i=0; i<s0.size(); i++)
+        select_smallest(est, i*s1.size(), 1, s1.size(), k, &buf, [&](size_t j) { pairs[i][j] = true; });
+    for (size_t j=0; j<s1.size(); j++)
+        select_smallest(est, j, s1.size(), s0.size(), k, &buf, [&](size_t i) { pairs[i][j] = true; });
+    return pairs;
+}
 
-    // build function histogram vectors
-    std::vector<std::vector<double> > v_s0, v_s1;
-    v_s0.resize(s0.size());
-    v_s1.resize(s1.size());
-    unsigned int i = 0;
-    for (auto &[f_s0, f_s0_hist] : s0.items()) {
-        for (auto &mnem : mnemonics) {
-            if (f_s0_hist.find(mnem) != f_s0_hist.end())
-                v_s0[i].push_back(f_s0_hist[mnem]);
-            else
-                v_s0[i].push_back(0.0);
+// Computes all row and column minima of the distance matrix of a tag (rows)
+// against the sample (columns). With candidates > 0 only the pairs selected
+// by select_candidate_pairs() are evaluated.
+template<typename T>
+static void calculate_minima(const std::vector<fhist_t> &s0, const sample_hist_t &s1,
+        size_t candidates, score_state_t *state) {
+    auto index = build_index(s0, s1.functions);
+    auto v_s0 = densify<T>(s0, index);
+    auto v_s1 = densify<T>(s1.functions, index);
+
+    state->row_min.assign(s0.size(), std::numeric_limits<double>::infinity());
+    state->row_argmin.assign(s0.size(), BADADDR);
+    state->col_min.assign(s1.functions.size(), std::numeric_limits<double>::infinity());
+    auto pairs = select_candidate_pairs(s0, s1.functions, candidates);
+    for (unsigned int i=0; i<s0.size(); i++) {
+        for (unsigned int j=0; j<s1.functions.size(); j++) {
+            if (!pairs.empty() && !pairs[i][j])
+                continue;
+            double d = calculate_function_distance(v_s0, i, v_s1, j);
+            if (d < state->row_min[i]) {
+                state->row_min[i] = d;
+                state->row_argmin[i] = s1.eas[j];
+            }
+            state->col_min[j] = std::min(state->col_min[j], d);
         }
-        i++;
     }
-    i = 0;
-    for (auto &[f_s1, f_s1_hist] : s1.items()) {
-        for (auto &mnem : mnemonics) {
-            if (f_s1_hist.find(mnem) != f_s1_hist.end())
-                v_s1[i].push_back(f_s1_hist[mnem]);
-            else
-                v_s1[i].push_back(0.0);
+}
+
+// Updates the minima after some sample functions changed. Only the columns of
+// changed functions and the rows whose minimum was in a changed or removed
+// column are computed again, all other minima are still exact. All pairs
+// are evaluated: the pairs selected by the sketches depend on every sample
+// function, so with pruning tags are scored again by calculate_minima().
+template<typename T>
+static void update_minima(const std::vector<fhist_t> &s0, const sample_hist_t &s1,
+        const sample_delta_t &delta, score_state_t *state) {
+    auto index = build_index(s0, s1.functions);
+    auto v_s0 = densify<T>(s0, index);
+    auto v_s1 = densify<T>(s1.functions, index);
+
+    std::vector<bool> stale_row(s0.size());
+    for (unsigned int i=0; i<s0.size(); i++)
+        stale_row[i] = delta.stale.count(state->row_argmin[i]) != 0;
+
+    std::vector<double> col_min(s1.functions.size());
+    for (unsigned int j=0; j<s1.functions.size(); j++) {
+        if (delta.col_source[j] >= 0) {
+            col_min[j] = state->col_min[delta.col_source[j]];
+            continue;
+        }
+        col_min[j] = std::numeric_limits<double>::infinity();
+        for (unsigned int i=0; i<s0.size(); i++) {
+            double d = calculate_function_distance(v_s0, i, v_s1, j);
+            col_min[j] = std::min(col_min[j], d);
+            if (!stale_row[i] && d < state->row_min[i]) {
+                state->row_min[i] = d;
+                state->row_argmin[i] = s1.eas[j];
+            }
         }
-        i++;
     }
+    state->col_min = std::move(col_min);
 
-    std::vector<std::vector<double> > D;
-    D.resize(v_s0.size());
-    i = 0;
-    for (auto &f_s0 : v_s0) {
-        unsigned int j = 0;
-        D[i].resize(v_s1.size());
-        for (auto &f_s1 : v_s1) {
-            double cosine_distance = calculate_cosine_function_distance(f_s0, f_s1);
-            double euclidean_distance = calculate_euclidean_function_distance(f_s0, f_s1);
-            D[i][j] = cosine_distance * euclidean_distance;
-            j += 1;
+    for (unsigned int i=0; i<s0.size(); i++) {
+        if (!stale_row[i])
+            continue;
+        state->row_min[i] = std::numeric_limits<double>::infinity();
+        for (unsigned int j=0; j<s1.functions.size(); j++) {
+            double d = calculate_function_distance(v_s0, i, v_s1, j);
+            if (d < state->row_min[i]) {
+                state->row_min[i] = d;
+                state->row_argmin[i] = s1.eas[j];
+            }
         }
-        i += 1;
     }
+}
+
+static void calculate_minima(const std::vector<fhist_t> &s0, const sample_hist_t &s1,
+        vector_storage_t storage, size_t candidates, score_state_t *state) {
+    switch (storage) {
+        case STORAGE_FLOAT: calculate_minima<float>(s0, s1, candidates, state); break;
+        case STORAGE_INT16: calculate_minima<int16_t>(s0, s1, candidates, state); break;
+        case STORAGE_UINT8: calculate_minima<uint8_t>(s0, s1, candidates, state); break;
+        default: calculate_minima<double>(s0, s1, candidates, state); break;
+    }
+}
+
+static void update_minima(const std::vector<fhist_t> &s0, const sample_hist_t &s1,
+        const sample_delta_t &delta, vector_storage_t storage, score_state_t *state) {
+    switch (storage) {
+        case STORAGE_FLOAT: update_minima<float>(s0, s1, delta, state); break;
+        case STORAGE_INT16: update_minima<int16_t>(s0, s1, delta, state); break;
+        case STORAGE_UINT8: update_minima<uint8_t>(s0, s1, delta, state); break;
+        default: update_minima<double>(s0, s1, delta, state); break;
+    }
+}
+
+static double score_minima(const score_state_t &state) {
+    if (state.row_min.empty() || state.col_min.empty())
+        return std::numeric_limits<double>::infinity();
 
     double dh = 0.0;
     double dv = 0.0;
-    for (auto &d_r : D) {
-        dh += *std::min_element(d_r.begin(), d_r.end());
+    for (auto d : state.row_min) {
+        dh += d;
     }
-    dv = dv / D.size();
-    auto Dt = transpose(D);
-    for (auto &d_r : Dt) {
-        dv += *std::min_element(d_r.begin(), d_r.end());
+    for (auto d : state.col_min) {
+        dv += d;
     }
-    dh = dh / Dt.size();
+    dh = dh / state.col_min.size();
 
     return (dh > dv) ? dh : dv;
 }
 
+// Relates the sample scored in the last run to the current sample. Returns
+// false if the retained minima can not be reused.
+static bool begin_scoring(const sample_hist_t &h, sample_delta_t *delta) {
+    if (rescore_all) {
+        scores.clear();
+        return false;
+    }
+
+    std::unordered_map<ea_t, int64_t> previous;
+    for (size_t k=0; k<scored_eas.size(); k++)
+        previous.emplace(scored_eas[k], k);
+
+    delta->col_source.resize(h.eas.size());
+    for (size_t j=0; j<h.eas.size(); j++) {
+        auto it = previous.find(h.eas[j]);
+        if (it == previous.end() || rescore_functions.count(h.eas[j]) != 0) {
+            delta->col_source[j] = -1;
+            delta->stale.insert(h.eas[j]);
+        } else {
+            delta->col_source[j] = it->second;
+            previous.erase(it);
+        }
+    }
+    // functions which are gone
+    for (auto &[ea, k] : previous)
+        delta->stale.insert(ea);
+    return true;
+}
+
+static void end_scoring(const sample_hist_t &h, const std::set<std::string> &scored, bool cancelled) {
+    for (auto it = scores.begin(); it != scores.end(); ) {
+        if (cancelled || scored.count(it->first) == 0)
+            it = scores.erase(it);
+        else
+            ++it;
+    }
+    scored_eas = h.eas;
+    rescore_functions.clear();
+    rescore_all = false;
+}
+
+// Returns the distance of a tag to the sample, reusing the minima retained
+// from the last run if only some sample functions changed since and pairs
+// are not pruned.
+static double score_tag(const std::string &path, const tag_entry_t &e,
+        const sample_hist_t &h, const sample_delta_t *delta) {
+    auto it = scores.find(path);
+    if (delta != NULL &&
+            config.sketch_candidates == 0 &&
+            it != scores.end() &&
+            it->second.size == e.size &&
+            it->second.mtime == e.mtime) {
+        if (!delta->stale.empty())
+            update_minima(e.tag.functions, h, *delta, config.storage, &it->second);
+        return score_minima(it->second);
+    }
+
+    auto &state = scores[path];
+    state.size = e.size;
+    state.mtime = e.mtime;
+    calculate_minima(e.tag.functions, h, config.storage, config.sketch_candidates, &state);
+    return score_minima(state);
+}
+
+// Scores a tag again with double vectors on all pairs and records the
+// largest absolute error of the configured storage type and pruning.
+static void verify_score(const tag_t &t, const sample_hist_t &h, double d, double *max_error) {
+    score_state_t exact;
+    calculate_minima(t.functions, h, STORAGE_DOUBLE, 0, &exact);
+    double e = score_minima(exact);
+    if (std::isfinite(e) && std::isfinite(d))
+        *max_error = std::max(*max_error, std::fabs(d - e));
+}
+
 /*
  * =====================================================================================
- * code related to the import of BinTags
+ * mnemonic classes
  * =====================================================================================
  */
 
-static bool skip_tag(json h, json t) {
-    bool err = false;
-    try {
-        // abi checks
-        if (inf_is_32bit() != t["arch"]["is_32bit"] ||
-                inf_is_64bit() != t["arch"]["is_64bit"]) {
-            true;
-        }
-
-        // # of functions
-        auto s_f = double(h.size());
-        auto s_t = double(t["histogram"].size());
-        if (h.size() != t["histogram"].size()) {
-            auto r = abs(s_f - s_t) / (s_f + s_t);
-            if (r > 0.3) {
-                return true;
+static const class_rule_t x86_class_rules[] = {
+    // string operations before the data movement and simd prefixes
+    { "movs", CLASS_STRING }, { "stos", CLASS_STRING }, { "lods", CLASS_STRING },
+    { "scas", CLASS_STRING }, { "cmps", CLASS_STRING }, { "ins", CLASS_STRING },
+    { "outs", CLASS_STRING }, { "rep*", CLASS_STRING },
+
+    { "mov", CLASS_DATA }, { "movzx", CLASS_DATA }, { "movsx", CLASS_DATA },
+    { "movsxd", CLASS_DATA }, { "lea", CLASS_DATA }, { "push*", CLASS_DATA },
+    { "pop*", CLASS_DATA }, { "xchg", CLASS_DATA }, { "cmov*", CLASS_DATA },
+    { "set*", CLASS_DATA }, { "leave", CLASS_DATA }, { "enter", CLASS_DATA },
+    { "bswap", CLASS_DATA }, { "cbw", CLASS_DATA }, { "cwde", CLASS_DATA },
+    { "cdqe", CLASS_DATA }, { "cwd", CLASS_DATA }, { "cdq", CLASS_DATA },
+    { "cqo", CLASS_DATA },
+
+    { "add", CLASS_ARITH }, { "adc", CLASS_ARITH }, { "sub", CLASS_ARITH },
+    { "sbb", CLASS_ARITH }, { "inc", CLASS_ARITH }, { "dec", CLASS_ARITH },
+    { "neg", CLASS_ARITH }, { "mul", CLASS_ARITH }, { "imul", CLASS_ARITH },
+    { "div", CLASS_ARITH }, { "idiv", CLASS_ARITH }, { "cmp", CLASS_ARITH },
+    { "xadd", CLASS_ARITH }, { "cmpxchg*", CLASS_ARITH },
+
+    { "and", CLASS_LOGIC }, { "or", CLASS_LOGIC }, { "xor", CLASS_LOGIC },
+    { "not", CLASS_LOGIC }, { "test", CLASS_LOGIC }, { "shl", CLASS_LOGIC },
+    { "shr", CLASS_LOGIC }, { "sal", CLASS_LOGIC }, { "sar", CLASS_LOGIC },
+    { "rol", CLASS_LOGIC }, { "ror", CLASS_LOGIC }, { "rcl", CLASS_LOGIC },
+    { "rcr", CLASS_LOGIC }, { "shld", CLASS_LOGIC }, { "shrd", CLASS_LOGIC },
+    { "bt*", CLASS_LOGIC }, { "bsf", CLASS_LOGIC }, { "bsr", CLASS_LOGIC },
+
+    { "call*", CLASS_CONTROL }, { "j*", CLASS_CONTROL }, { "ret*", CLASS_CONTROL },
+    { "loop*", CLASS_CONTROL }, { "int*", CLASS_CONTROL }, { "syscall", CLASS_CONTROL },
+    { "sysenter", CLASS_CONTROL },
+
+    { "f*", CLASS_FPU },
+
+    { "p*", CLASS_SIMD }, { "v*", CLASS_SIMD }, { "mov*", CLASS_SIMD },
+    { "cvt*", CLASS_SIMD }, { "*ps", CLASS_SIMD }, { "*pd", CLASS_SIMD },
+    { "*ss", CLASS_SIMD }, { "*sd", CLASS_SIMD },
+};
+
+static const class_table_t class_tables[] = {
+    { PLFM_386, x86_class_rules, qnumber(x86_class_rules) },
+};
+
+static bool match_class_rule(const char *pattern, const std::string &mnem) {
+    size_t n = strlen(pattern);
+    if (n > 0 && pattern[n-1] == '*')
+        return mnem.compare(0, n-1, pattern, n-1) == 0;
+    if (n > 0 && pattern[0] == '*')
+        return mnem.size() >= n-1 && mnem.compare(mnem.size()-(n-1), n-1, pattern+1) == 0;
+    return mnem == pattern;
+}
+
+// Returns the class table of the loaded processor or NULL. Mnemonic classes
+// of another processor are dropped.
+static const class_table_t *get_class_table() {
+    if (class_proc != ph.id) {
+        class_proc = ph.id;
+        mnemonic_classes.clear();
+        tag_classes.clear();
+    }
+    for (auto &t : class_tables) {
+        if (t.proc_id == ph.id)
+            return &t;
+    }
+    return NULL;
+}
+
+// projects histograms onto the classes of the given table
+static std::vector<fhist_t> project_classes(const class_table_t &table, const std::vector<fhist_t> &functions) {
+    while (mnemonic_classes.size() < mnemonics.names.size()) {
+        auto &mnem = mnemonics.names[mnemonic_classes.size()];
+        mnemonic_class_t cls = CLASS_OTHER;
+        for (size_t k=0; k<table.size; k++) {
+            if (match_class_rule(table.rules[k].pattern, mnem)) {
+                cls = table.rules[k].cls;
+                break;
             }
         }
-    } catch (json::exception &e) {
-        msg("BinTag [WARNING]: broken tag file\n");
-        err = true;
+        mnemonic_classes.push_back(cls);
+    }
+
+    std::vector<fhist_t> classes(functions.size());
+    for (size_t k=0; k<functions.size(); k++) {
+        for (auto &[id, count] : functions[k].counts)
+            classes[k].counts.push_back({mnemonic_classes[id], count});
+        finalize_fhist(&classes[k]);
+    }
+    return classes;
+}
+
+static const std::vector<fhist_t> &get_tag_classes(const class_table_t &table,
+        const std::string &path, const tag_entry_t &e) {
+    auto &state = tag_classes[path];
+    if (state.functions.empty() || state.size != e.size || state.mtime != e.mtime) {
+        state.size = e.size;
+        state.mtime = e.mtime;
+        state.functions = project_classes(table, e.tag.functions);
+    }
+    return state.functions;
+}
+
+// Ranks the candidate tags by their distance on the mnemonic classes, which
+// is computed like the full score over a handful of dimensions, and keeps
+// the best ones for the full comparison.
+// drops the projections of tags which left the corpus or changed
+static void sync_tag_classes(const std::map<std::string, tag_entry_t> &tags) {
+    for (auto it = tag_classes.begin(); it != tag_classes.end(); ) {
+        auto t = tags.find(it->first);
+        if (t != tags.end() &&
+                t->second.size == it->second.size &&
+                t->second.mtime == it->second.mtime)
+            ++it;
+        else
+            it = tag_classes.erase(it);
+    }
+}
+
+static void rank_by_classes(const sample_hist_t &h, size_t keep,
+        std::vector<const std::pair<const std::string, tag_entry_t> *> *candidates) {
+    if (candidates->size() <= keep)
+        return;
+    auto *table = get_class_table();
+    if (table == NULL)
+        return;
+
+    sample_hist_t classes;
+    classes.eas = h.eas;
+    classes.functions = project_classes(*table, h.functions);
+
+    std::vector<std::pair<double, const std::pair<const std::string, tag_entry_t> *> > ranked;
+    for (auto *c : *candidates) {
+        score_state_t state;
+        calculate_minima(get_tag_classes(*table, c->first, c->second), classes, STORAGE_DOUBLE, 0, &state);
+        ranked.push_back({score_minima(state), c});
+    }
+    std::stable_sort(ranked.begin(), ranked.end(), [](auto const &a, auto const &b) {
+        return a.first < b.first;
+    });
+
+    msg("BinTag [INFO]: %zu of %zu tags kept by the mnemonic class ranking\n", keep, ranked.size());
+    candidates->clear();
+    for (size_t k=0; k<keep; k++)
+        candidates->push_back(ranked[k].second);
+}
+
+/*
+ * =====================================================================================
+ * code related to the import of BinTags
+ * =====================================================================================
+ */
+
+// Earth mover's distance of two sorted size distributions on a logarithmic
+// scale, the mean difference of log(1+n) between the quantile functions.
+// Both step functions are walked in a single merge pass, steps are counted
+// in units of 1/(n0*n1) to stay exact.
+static double calculate_size_distance(const std::vector<uint32_t> &s0, const std::vector<uint32_t> &s1) {
+    if (s0.empty() || s1.empty())
+        return s0.empty() && s1.empty() ? 0.0 : std::numeric_limits<double>::infinity();
+    uint64_t n0 = s0.size();
+    uint64_t n1 = s1.size();
+    uint64_t q = 0;
+    size_t i0 = 0;
+    size_t i1 = 0;
+    double d = 0.0;
+    while (i0 < n0 && i1 < n1) {
+        uint64_t e0 = (i0+1) * n1;
+        uint64_t e1 = (i1+1) * n0;
+        uint64_t e = std::min(e0, e1);
+        d += double(e - q) * std::fabs(std::log1p(double(s0[i0])) - std::log1p(double(s1[i1])));
+        q = e;
+        if (e0 == e)
+            i0++;
+        if (e1 == e)
+            i1++;
+    }
+    return d / (double(n0) * double(n1));
+}
+
+static bool skip_tag(const sample_hist_t &h, const std::vector<uint32_t> &sizes, const tag_t &t) {
+    // tags built with another library policy which could not be adapted or
+    // with a higher threshold are not comparable
+    if (t.lib_policy != h.lib_policy || t.min_insns > h.min_insns)
+        return true;
+
+    // abi checks
+    if (inf_is_32bit() != t.is_32bit ||
+            inf_is_64bit() != t.is_64bit) {
+        true;
     }
-    if (err)
+
+    // # of functions
+    auto s_f = double(h.functions.size());
+    auto s_t = double(t.functions.size());
+    if (h.functions.size() != t.functions.size()) {
+        auto r = abs(s_f - s_t) / (s_f + s_t);
+        if (r > 0.3) {
+            return true;
+        }
+    }
+
+    // distribution of function sizes
+    if (config.size_threshold > 0.0 &&
+            calculate_size_distance(sizes, t.sizes) > config.size_threshold)
         return true;
 
     return false;
@@ -434,19 +2792,181 @@ static bool skip_tag(json h, json t) {
  * =====================================================================================
  */
 
-static bool same_imports(std::list<std::string> sample_imports) {
-    auto imports = get_imports();
-    if (sample_imports.size() != imports.size())
-        return false;
-    imports.sort();
-    sample_imports.sort();
-    for (int i=0; i<imports.size(); i++) {
-        if (imports.back() != sample_imports.back())
+// Jaccard similarity of two hashed import sets in a single merge pass
+static double calculate_jaccard(const std::vector<uint64_t> &s0, const std::vector<uint64_t> &s1) {
+    if (s0.empty() || s1.empty())
+        return 0.0;
+    size_t common = 0;
+    auto i0 = s0.begin();
+    auto i1 = s1.begin();
+    while (i0 != s0.end() && i1 != s1.end()) {
+        if (*i0 < *i1) {
+            ++i0;
+        } else if (*i1 < *i0) {
+            ++i1;
+        } else {
+            common++;
+            ++i0;
+            ++i1;
+        }
+    }
+    return double(common) / double(s0.size() + s1.size() - common);
+}
+
+// Estimates the jaccard similarity of the sample imports and the imports of
+// a tag by looking the sample imports up in the bloom filter of the tag.
+// False positives can only raise the estimate.
+static double estimate_import_similarity(const std::vector<uint64_t> &sample_imports, const tag_t &t) {
+    auto &bloom = t.import_bloom;
+    if (sample_imports.empty() || bloom.empty())
+        return 0.0;
+    size_t mask = bloom.size()*64 - 1;
+    size_t hits = 0;
+    for (auto h : sample_imports) {
+        bool found = true;
+        for (size_t k=0; k<bintag_bloom_probes && found; k++) {
+            size_t bit = (h >> (k*21)) & mask;
+            found = (bloom[bit / 64] >> (bit % 64)) & 1;
+        }
+        hits += found;
+    }
+    hits = std::min(hits, t.import_hashes.size());
+    return double(hits) / double(sample_imports.size() + t.import_hashes.size() - hits);
+}
+
+static std::vector<uint64_t> band_keys(const std::vector<uint64_t> &sig) {
+    constexpr size_t rows = bintag_minhash_size / bintag_lsh_bands;
+    std::vector<uint64_t> keys;
+    if (sig.empty())
+        return keys;
+    for (size_t b=0; b<bintag_lsh_bands; b++) {
+        uint64_t h = b;
+        for (size_t r=0; r<rows; r++)
+            h = (h ^ sig[b*rows + r]) * 0x100000001b3ull;
+        keys.push_back(h);
+    }
+    return keys;
+}
+
+// Brings the lsh index up to date with the corpus, only tags which were
+// added, changed or removed since the last call are touched.
+static void sync_import_index(const std::map<std::string, tag_entry_t> &tags) {
+    for (auto it = import_index.indexed.begin(); it != import_index.indexed.end(); ) {
+        auto t = tags.find(it->first);
+        if (t != tags.end() &&
+                t->second.size == it->second.size &&
+                t->second.mtime == it->second.mtime) {
+            ++it;
+            continue;
+        }
+        for (auto key : it->second.keys) {
+            auto b = import_index.buckets.find(key);
+            b->second.erase(it->first);
+            if (b->second.empty())
+                import_index.buckets.erase(b);
+        }
+        it = import_index.indexed.erase(it);
+    }
+
+    for (auto &[path, e] : tags) {
+        if (import_index.indexed.count(path) != 0)
+            continue;
+        auto keys = band_keys(e.tag.import_minhash);
+        for (auto key : keys)
+            import_index.buckets[key].insert(path);
+        import_index.indexed[path] = {e.size, e.mtime, std::move(keys)};
+    }
+}
+
+// returns the tags sharing at least one band with the signature
+static std::set<std::string> find_import_similar(const std::vector<uint64_t> &sig) {
+    std::set<std::string> paths;
+    for (auto key : band_keys(sig)) {
+        auto it = import_index.buckets.find(key);
+        if (it != import_index.buckets.end())
+            paths.insert(it->second.begin(), it->second.end());
+    }
+    return paths;
+}
+
+/*
+ * =====================================================================================
+ * combined scoring
+ * =====================================================================================
+ */
+
+static double bound_imports(score_ctx_t *ctx, const std::string &, const tag_entry_t &e) {
+    return 1.0 - estimate_import_similarity(ctx->imports, e.tag);
+}
+
+static double score_imports(score_ctx_t *ctx, const std::string &, const tag_entry_t &e) {
+    return 1.0 - calculate_jaccard(ctx->imports, e.tag.import_hashes);
+}
+
+// the intersection is at most the smaller set
+static double bound_strings(score_ctx_t *ctx, const std::string &, const tag_entry_t &e) {
+    auto n0 = ctx->strings.size();
+    auto n1 = e.tag.string_hashes.size();
+    if (n0 == 0 || n1 == 0)
+        return 1.0;
+    return 1.0 - double(std::min(n0, n1)) / double(std::max(n0, n1));
+}
+
+static double score_strings(score_ctx_t *ctx, const std::string &, const tag_entry_t &e) {
+    return 1.0 - calculate_jaccard(ctx->strings, e.tag.string_hashes);
+}
+
+static double score_sizes(score_ctx_t *ctx, const std::string &, const tag_entry_t &e) {
+    return calculate_size_distance(ctx->sizes, e.tag.sizes);
+}
+
+// distances are never negative
+static double bound_mnemonics(score_ctx_t *, const std::string &, const tag_entry_t &) {
+    return 0.0;
+}
+
+static double score_mnemonics(score_ctx_t *ctx, const std::string &path, const tag_entry_t &e) {
+    double d = score_tag(path, e, *ctx->h, ctx->delta);
+    if (ctx->verify)
+        verify_score(e.tag, *ctx->h, d, &ctx->storage_error);
+    ctx->scored.insert(path);
+    return d;
+}
+
+// indexed by channel_id_t
+static const channel_t channels[] = {
+    { bound_imports, score_imports },
+    { bound_strings, score_strings },
+    { score_sizes, score_sizes },
+    { bound_mnemonics, score_mnemonics },
+};
+
+// Computes the weighted sum of the channel distances of a tag. The channels
+// run cheapest first, the remaining ones are skipped as soon as the exact
+// distances so far plus the bounds of the rest reach cutoff. Returns false
+// for such tags.
+static bool combine_channels(score_ctx_t *ctx, const std::string &path, const tag_entry_t &e,
+        double cutoff, double *d) {
+    double bounds[CHANNEL_COUNT] = {};
+    double rest = 0.0;
+    for (size_t c=0; c<CHANNEL_COUNT; c++) {
+        if (config.weights[c] > 0.0) {
+            bounds[c] = config.weights[c] * channels[c].bound(ctx, path, e);
+            rest += bounds[c];
+        }
+    }
+
+    double exact = 0.0;
+    for (size_t c=0; c<CHANNEL_COUNT; c++) {
+        if (!(exact + rest < cutoff))
             return false;
-        imports.pop_back();
-        sample_imports.pop_back();
+        if (config.weights[c] == 0.0)
+            continue;
+        rest -= bounds[c];
+        exact += config.weights[c] * channels[c].score(ctx, path, e);
     }
-    return true;
+    *d = exact;
+    return exact < cutoff;
 }
 
 /*
@@ -498,51 +3018,98 @@ static void bintag() {
 
     show_wait_box("BinTag computing distances");
 
-    // load tags from tag directory
-    auto tags = load_tags();
+    // bring tags from tag directory up to date
+    auto &tags = load_tags();
 
     // build mnemonics histogram
-    auto h = get_mnem_histogram();
+    auto &h = get_sample_histogram();
+
+    // relate the sample to the one of the last run
+    sample_delta_t delta;
+    bool incremental = begin_scoring(h, &delta);
+    bool cancelled = h.cancelled;
+
+    // features of the sample, extracted once per run
+    score_ctx_t ctx;
+    ctx.h = &h;
+    ctx.delta = incremental ? &delta : NULL;
+    ctx.imports = hash_set(get_imports());
+    if (config.weights[CHANNEL_STRINGS] > 0.0)
+        ctx.strings = get_string_hashes();
+    ctx.sizes = function_sizes(h.functions);
+    ctx.verify = config.verify_storage &&
+        (config.storage != STORAGE_DOUBLE || config.sketch_candidates > 0);
+    ctx.storage_error = 0.0;
+    auto &sample_imports = ctx.imports;
+    auto sample_minhash = minhash_imports(sample_imports);
+
+    // tags whose imports barely overlap are dropped before any histogram work
+    bool filter_imports = config.import_threshold > 0.0 && !sample_imports.empty();
+    size_t filtered = 0;
+
+    std::vector<const std::pair<const std::string, tag_entry_t> *> candidates;
+    for (auto &t : tags) {
+        if (filter_imports &&
+                estimate_import_similarity(sample_imports, t.second.tag) < config.import_threshold) {
+            filtered++;
+            continue;
+        }
+        if (skip_tag(h, ctx.sizes, t.second.tag)) {
+            msg("BinTag [INFO]: skipping tag %s\n", t.second.tag.name.c_str());
+            continue;
+        }
+        candidates.push_back(&t);
+    }
+    if (filter_imports)
+        msg("BinTag [INFO]: %zu tags dropped by the import filter\n", filtered);
+    if (config.class_prefilter > 0) {
+        sync_tag_classes(tags);
+        rank_by_classes(h, config.class_prefilter, &candidates);
+    }
 
-    std::vector<std::tuple<std::string, double, std::string, std::list<std::string> > > distances;
-    for (auto &tag : tags) {
-        if (user_cancelled())
+    std::vector<std::tuple<std::string, double, std::string, double, std::string> > distances;
+    size_t ruled_out = 0;
+    for (auto *c : candidates) {
+        auto &[tag_path, tag_entry] = *c;
+        auto &tag = tag_entry.tag;
+        if (user_cancelled()) {
+            cancelled = true;
             break;
-        if (skip_tag(h, tag)) {
-            try {
-                msg("BinTag [INFO]: skipping tag %s\n", tag["tag"].get<std::string>().c_str());
-            } catch (json::exception &e) {
-                msg("BinTag [WARNING]: corrupt tag data\n");
-            }
-            continue;
         }
 
-        double d = -1;
-        std::list<std::string> imports;
-        try {
-            d = calculate_distance(tag["histogram"], h);
-            for (auto &import : tag["imports"]) {
-                imports.push_back(import);
-            }
-            distances.push_back({tag["tag"].get<std::string>(),
-                    d,
-                    tag["description"].get<std::string>(),
-                    imports});
-        } catch (json::exception &e) {
-            msg("BinTag [WARNING]: corrupt tag data\n");
+        double d;
+        if (!combine_channels(&ctx, tag_path, tag_entry, bintag_display_distance, &d)) {
+            ruled_out++;
+            continue;
         }
+        distances.push_back({tag.name,
+                d,
+                tag.description,
+                calculate_jaccard(sample_imports, tag.import_hashes),
+                tag_path});
     }
-
+    end_scoring(h, ctx.scored, cancelled);
+    msg("BinTag [INFO]: %zu of %zu tags ruled out, %zu scored on mnemonics\n",
+            ruled_out, candidates.size(), ctx.scored.size());
+    if (ctx.verify)
+        msg("BinTag [INFO]: %s vector storage, %zu sketch candidates: max score error %g\n",
+                vector_storage_names[config.storage], config.sketch_candidates, ctx.storage_error);
+
+    // equal distances are ranked by import similarity
     auto sortfunction = [](auto const &a, auto const &b) {
-        return std::get<1>(a) < std::get<1>(b);
+        if (std::get<1>(a) != std::get<1>(b))
+            return std::get<1>(a) < std::get<1>(b);
+        return std::get<3>(a) > std::get<3>(b);
     };
     std::sort(distances.begin(), distances.end(), sortfunction);
 
     bintag_info_t *si = new bintag_info_t();
     last_si = si;
+    std::set<std::string> shown;
     for (auto &dist : distances) {
         auto d = std::get<1>(dist);
-        if (d < 5.0) {
+        if (d < bintag_display_distance) {
+            shown.insert(std::get<4>(dist));
             std::stringstream ss;
             ss <<
                 COLOR_ON << SCOLOR_DNAME <<
@@ -552,13 +3119,13 @@ static void bintag() {
                 " (" << d << ")" <<
                 COLOR_OFF << SCOLOR_NUMBER;
             si->sv.push_back(simpleline_t(ss.str().c_str())); // add tag name and distance
-            if (same_imports(std::get<3>(dist))) {
+            if (std::get<3>(dist) > 0.0) {
                 std::stringstream ss;
                 ss <<
                     COLOR_ON << SCOLOR_AUTOCMT <<
-                    "* imports match" <<
+                    "* import similarity " << std::get<3>(dist) <<
                     COLOR_OFF << SCOLOR_AUTOCMT;
-                si->sv.push_back(simpleline_t(ss.str().c_str())); // add tag name and distance
+                si->sv.push_back(simpleline_t(ss.str().c_str())); // add import similarity
             }
             auto description = std::get<2>(dist);
             std::istringstream lines(description);
@@ -569,6 +3136,36 @@ static void bintag() {
             si->sv.push_back(simpleline_t("")); // add empty line
         }
     }
+
+    // tags with similar imports which are not listed above, candidates are
+    // found through the lsh index without comparing every tag
+    sync_import_index(tags);
+    std::vector<std::pair<double, std::string> > similar;
+    for (auto &path : find_import_similar(sample_minhash)) {
+        auto it = tags.find(path);
+        if (shown.count(path) != 0 || it == tags.end())
+            continue;
+        double j = calculate_jaccard(sample_imports, it->second.tag.import_hashes);
+        if (j >= bintag_import_similar)
+            similar.push_back({j, it->second.tag.name});
+    }
+    std::sort(similar.rbegin(), similar.rend());
+    if (!similar.empty()) {
+        std::stringstream ss;
+        ss << COLOR_ON << SCOLOR_AUTOCMT << "Tags with similar imports" << COLOR_OFF << SCOLOR_AUTOCMT;
+        si->sv.push_back(simpleline_t(ss.str().c_str()));
+    }
+    for (auto &[j, name] : similar) {
+        std::stringstream ss;
+        ss <<
+            COLOR_ON << SCOLOR_DNAME <<
+            name <<
+            COLOR_OFF << SCOLOR_DNAME <<
+            COLOR_ON << SCOLOR_NUMBER <<
+            " (import similarity " << j << ")" <<
+            COLOR_OFF << SCOLOR_NUMBER;
+        si->sv.push_back(simpleline_t(ss.str().c_str()));
+    }
     hide_wait_box();
 
     simpleline_place_t s1;
@@ -579,6 +3176,26 @@ static void bintag() {
     return;
 }
 
+static json build_tag(const sample_hist_t &hist, const char *name, const char *description) {
+    json tag;
+    std::vector<std::string> library;
+    tag["histogram"] = histogram_to_json(hist, &library);
+    tag["library"] = library;   // lets tags built with keep be adapted to other policies
+    tag["tag"] = name;
+    tag["description"] = description;
+    tag["arch"] = json();
+    tag["arch"]["is_64bit"] = inf_is_64bit();
+    tag["arch"]["is_32bit"] = inf_is_32bit();
+    tag["imports"] = get_imports();
+    // building the string list is costly, strings are only recorded while
+    // they are part of the score
+    if (config.weights[CHANNEL_STRINGS] > 0.0)
+        tag["string_hashes"] = get_string_hashes();
+    tag["library_functions"] = lib_policy_names[hist.lib_policy];
+    tag["min_instructions"] = hist.min_insns;
+    return tag;
+}
+
 bool idaapi add_tag() {
     qstring tagname = "Tag";
     qstring description;
@@ -616,12 +3233,15 @@ bool idaapi add_tag() {
         return false;
     }
     auto tag_file = tag_dir / tagname.c_str();
+    if (!is_tag_file(tag_file)) {
+        // would be taken for a temporary file and never loaded
+        msg("BinTag [ERROR]: tag names of the form .name.tmp are reserved\n");
+        return false;
+    }
     if (is_regular_file(tag_file)) {
         // overwrite ?
         if (ask_yn(ASKBTN_NO, "Overwrite tag at %s?", tag_file.c_str()) == ASKBTN_NO)
             return false;
-        // delete old tag_file
-        fs::remove(tag_file);
     } else if (fs::exists(tag_file)) {
         // something is there but it is not a regular file...
         msg("BinTag [ERROR]: file at %s is not a regular file\n", tag_file.c_str());
@@ -629,19 +3249,28 @@ bool idaapi add_tag() {
     }
 
     // write histogram of currently opened sample to tag file
-    auto hist = get_mnem_histogram();
-    json tag;
-    tag["histogram"] = hist;
-    tag["tag"] = tagname.c_str();
-    tag["description"] = ti.text.c_str();
-    tag["arch"] = json();
-    tag["arch"]["is_64bit"] = inf_is_64bit();
-    tag["arch"]["is_32bit"] = inf_is_32bit();
-    tag["imports"] = get_imports();
-    std::ofstream o(tag_file.c_str());
-    o << tag << std::endl;
-    o.close();
+    auto tag = build_tag(get_sample_histogram(), tagname.c_str(), ti.text.c_str());
+
+    return store_tag(tag_file, tag);
+}
 
+// Writes a tag of the loaded sample to path, used by the headless export
+// (-Obintag:export:path) which replaces the former IDAPython export script.
+static bool export_tag(const char *path) {
+    char root[QMAXPATH];
+    if (get_root_filename(root, sizeof(root)) <= 0)
+        root[0] = '\0';
+    auto h = get_mnem_histogram(config.lib_policy, config.min_insns);
+    auto tag = build_tag(h, root, "");
+
+    std::ofstream o(path);
+    // names and imports are not necessarily valid utf-8
+    o << tag.dump(-1, ' ', false, json::error_handler_t::replace) << std::endl;
+    o.close();
+    if (!o) {
+        msg("BinTag [ERROR]: could not write %s\n", path);
+        return false;
+    }
     return true;
 }
 
@@ -657,7 +3286,90 @@ static ssize_t idaapi idp_callback(void *, int event_id, va_list) {
     return 0;
 }
 
+static ssize_t idaapi idb_callback(void *, int event_id, va_list va) {
+    switch (event_id) {
+        case idb_event::closebase:
+            generation_changed = false;
+            sample_valid = false;
+            sample = sample_hist_t();
+            insn_cache.clear();
+            itypes = itype_map_t();
+            dirty_functions.clear();
+            rescore_all = true;
+            break;
+        case idb_event::func_added:
+        case idb_event::deleting_func:
+        case idb_event::func_updated: {
+            func_t *pfn = va_arg(va, func_t *);
+            dirty_functions.insert(pfn->start_ea);
+            invalidate_histogram();
+            break;
+        }
+        case idb_event::set_func_start:
+        case idb_event::set_func_end: {
+            func_t *pfn = va_arg(va, func_t *);
+            ea_t new_ea = va_arg(va, ea_t);
+            mark_function(pfn->start_ea);
+            if (event_id == idb_event::set_func_start && (pfn->flags & FUNC_TAIL) == 0)
+                dirty_functions.insert(new_ea);
+            invalidate_histogram();
+            break;
+        }
+        case idb_event::func_tail_appended:
+        case idb_event::func_tail_deleted: {
+            func_t *pfn = va_arg(va, func_t *);
+            dirty_functions.insert(pfn->start_ea);
+            invalidate_histogram();
+            break;
+        }
+        case idb_event::tail_owner_changed: {
+            va_arg(va, func_t *);
+            dirty_functions.insert(va_arg(va, ea_t));
+            dirty_functions.insert(va_arg(va, ea_t));
+            invalidate_histogram();
+            break;
+        }
+        case idb_event::make_code: {
+            const insn_t *insn = va_arg(va, const insn_t *);
+            mark_function(insn->ea);
+            invalidate_histogram();
+            break;
+        }
+        case idb_event::make_data:
+        case idb_event::byte_patched: {
+            ea_t ea = va_arg(va, ea_t);
+            mark_function(ea);
+            invalidate_histogram();
+            break;
+        }
+        case idb_event::destroyed_items: {
+            ea_t ea1 = va_arg(va, ea_t);
+            ea_t ea2 = va_arg(va, ea_t);
+            mark_functions(ea1, ea2);
+            invalidate_histogram();
+            break;
+        }
+    }
+    return 0;
+}
+
+static ssize_t idaapi export_callback(void *, int event_id, va_list) {
+    if (event_id == idb_event::auto_empty_finally)
+        qexit(export_tag(export_path.c_str()) ? 0 : 1);
+    return 0;
+}
+
 int idaapi init(void) {
+    load_config();
+
+    // headless export, the tag is written once auto-analysis is done
+    const char *options = get_plugin_options("bintag");
+    if (options != NULL && strncmp(options, "export:", 7) == 0) {
+        export_path = options + 7;
+        hook_to_notification_point(HT_IDB, export_callback);
+        return PLUGIN_KEEP;
+    }
+
     if (!is_idaq())
         return PLUGIN_SKIP;
 
@@ -675,11 +3387,17 @@ int idaapi init(void) {
     }
 
     hook_to_notification_point(HT_IDP, idp_callback);
+    hook_to_notification_point(HT_IDB, idb_callback);
     return PLUGIN_KEEP;
 }
 
 void idaapi term(void) {
     unhook_from_notification_point(HT_IDP, idp_callback);
+    unhook_from_notification_point(HT_IDB, idb_callback);
+    unhook_from_notification_point(HT_IDB, export_callback);
+    stop_watcher();
+    if (corpus_loaded && cache_dirty())
+        store_cache();
 }
 
 bool idaapi run(size_t) {
@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+
+# ==============================================================================
+# date:      2026-10-18
+# sharing:   TLP:GREEN
+# reference: internal tooling
+#
+# BinTag corpus builder
+# This script builds BinTag definitions from the Malpedia repository. Samples
+# are exported by a bounded pool of headless IDA instances running the BinTag
+# plugin, so tags are extracted exactly like Add BinTag does. Every tag is
+# written to a staging directory and moved into the tag directory as soon as
+# its export finished, so the tag directory only ever holds complete tags.
+# Samples whose SHA-256 is already present in the tag directory are skipped,
+# so an interrupted run is resumed by running the script again.
+#
+# requirements:
+#   * ida and ida64 in $PATH
+#   * the BinTag plugin installed for both
+#
+# usage: % ./build_corpus.py [-j jobs] path/to/malpedia
+#
+# ==============================================================================
+
+import argparse
+import hashlib
+import json
+import os
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+from concurrent.futures import ThreadPoolExecutor, as_completed
+
+from read_malpedia_information import read_info
+
+# ==============================================================================
+# constants
+# ==============================================================================
+
+BINTAG_PATH = os.path.join(os.path.expanduser("~"), ".bintag")
+TAG_PATH = os.path.join(BINTAG_PATH, "tags")
+
+PE32_MAGIC = 0x10b
+PE32_64_MAGIC = 0x20b
+
+SHA256_SUFFIX = re.compile(r"-([0-9a-f]{64})$")
+
+# ==============================================================================
+# output
+# ==============================================================================
+
+def infomsg(m):
+    print("\033[36m\033[40m\033[1mINFO:\033[0m %s" % m, flush=True)
+
+def warnmsg(m):
+    print("\033[33m\033[40m\033[1mWARNING:\033[0m %s" % m, flush=True)
+
+def resultmsg(m):
+    print("\033[32m\033[40m\033[1mRESULT:\033[0m %s" % m, flush=True)
+
+# ==============================================================================
+# implementation
+# ==============================================================================
+
+def pe_magic(path):
+    """Returns the optional header magic of a PE file or None."""
+    try:
+        with open(path, "rb") as f:
+            mz = f.read(64)
+            if len(mz) < 64 or mz[:2] != b"MZ":
+                return None
+            e_lfanew = struct.unpack_from("<I", mz, 0x3c)[0]
+            f.seek(e_lfanew)
+            hdr = f.read(26)
+    except OSError:
+        return None
+    if len(hdr) < 26 or hdr[:4] != b"PE\0\0":
+        return None
+    return struct.unpack_from("<H", hdr, 24)[0]
+
+def find_samples(malpedia):
+    samples = []
+    for root, dirs, files in os.walk(malpedia):
+        dirs[:] = [ d for d in dirs if not d.startswith(".") ]
+        for name in files:
+            if name.lower().endswith((".json", ".txt")) or "_" in name:
+                continue
+            path = os.path.join(root, name)
+            magic = pe_magic(path)
+            if magic == PE32_MAGIC:
+                samples.append((path, False))
+            elif magic == PE32_64_MAGIC:
+                samples.append((path, True))
+    samples.sort()
+    return samples
+
+def sha256(path):
+    h = hashlib.sha256()
+    with open(path, "rb") as f:
+        for chunk in iter(lambda: f.read(1 << 20), b""):
+            h.update(chunk)
+    return h.hexdigest()
+
+def known_hashes():
+    """Collects the hashes of all samples already present in the tag store."""
+    hashes = set()
+    if not os.path.isdir(TAG_PATH):
+        return hashes
+    for name in os.listdir(TAG_PATH):
+        m = SHA256_SUFFIX.search(name)
+        if m:
+            hashes.add(m.group(1))
+    return hashes
+
+def build_tag(sample, is_64bit, digest, staging):
+    """Exports a single sample with a headless IDA and moves the tag into the
+    tag directory."""
+    info = read_info(sample)
+    common_name = info.get("common_name", "unknown").replace(os.sep, "-")
+    name = "malpedia-%s-%s" % (common_name, digest)
+
+    workdir = tempfile.mkdtemp(prefix="bintag-", dir=staging)
+    try:
+        out = os.path.join(workdir, "hist.json")
+        ida = "ida64" if is_64bit else "ida"
+        db = os.path.join(workdir, "db")
+        cmd = [ida, "-B", "-o%s" % db, "-Obintag:export:%s" % out, sample]
+        subprocess.run(cmd, cwd=workdir, check=False,
+                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        with open(out, "r") as f:
+            tag = json.load(f)
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    tag["tag"] = name
+    tag["description"] = info.get("description", "")
+    tag["sha256"] = digest
+    staged = os.path.join(staging, name)
+    with open(staged, "w") as f:
+        json.dump(tag, f)
+    os.replace(staged, os.path.join(TAG_PATH, name))
+    return name
+
+# ==============================================================================
+# main
+# ==============================================================================
+
+def main():
+    parser = argparse.ArgumentParser(description="build BinTag definitions from Malpedia")
+    parser.add_argument("-j", "--jobs", type=int, default=os.cpu_count() or 1,
+                        help="number of concurrent IDA instances")
+    parser.add_argument("malpedia", help="path to the Malpedia repository")
+    args = parser.parse_args()
+
+    samples = find_samples(args.malpedia)
+    infomsg("found %d PE32 files" % sum(1 for s in samples if not s[1]))
+    infomsg("found %d PE32+ files" % sum(1 for s in samples if s[1]))
+
+    os.makedirs(TAG_PATH, exist_ok=True)
+    known = known_hashes()
+    pending = []
+    for path, is_64bit in samples:
+        digest = sha256(path)
+        if digest in known:
+            continue
+        known.add(digest)
+        pending.append((path, is_64bit, digest))
+    infomsg("skipping %d samples already in the tag store" % (len(samples) - len(pending)))
+
+    staging = tempfile.mkdtemp(prefix="staging-", dir=BINTAG_PATH)
+    names = []
+    failed = 0
+    start = time.monotonic()
+    try:
+        with ThreadPoolExecutor(max_workers=max(1, args.jobs)) as pool:
+            futures = { pool.submit(build_tag, p, b, d, staging): p for p, b, d in pending }
+            for n, future in enumerate(as_completed(futures), 1):
+                try:
+                    names.append(future.result())
+                except Exception as e:
+                    failed += 1
+                    warnmsg("could not export %s: %s" % (futures[future], e))
+                elapsed = time.monotonic() - start
+                infomsg("[%d/%d] %s (%.2f samples/s)" % (n, len(pending), futures[future], n / elapsed))
+    finally:
+        shutil.rmtree(staging, ignore_errors=True)
+
+    elapsed = time.monotonic() - start
+    rate = len(names) / elapsed if elapsed > 0 else 0.0
+    resultmsg("import completed: %d tags added, %d failed in %.1fs (%.2f samples/s)"
+              % (len(names), failed, elapsed, rate))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())